@@ -18,10 +18,21 @@
  */
 
 #include <stdint.h>
+#include <proto/exec.h>
+#include <proto/timer.h>
+#include <exec/execbase.h>
+#include <devices/timer.h>
 
 //#include "common.h"
 #include "timer.h"
 
+struct Device *TimerBase;
+
+static struct timerequest timer_req;
+static int use_eclock;
+static uint32_t us_int;		/* microseconds per EClock tick, integer part */
+static uint32_t us_frac;	/* and fraction in 1/65536 */
+
 static volatile uint8_t * const todl = (volatile uint8_t*)0xbfe801;
 static volatile uint8_t * const todm = (volatile uint8_t*)0xbfe901;
 static volatile uint8_t * const todh = (volatile uint8_t*)0xbfea01;
@@ -44,3 +55,113 @@ void timer_delay(uint32_t ticks)
 
 	}
 }
+
+int timer_init(void)
+{
+	struct EClockVal ev;
+	uint32_t freq, rem;
+	int i;
+
+	if (TimerBase)
+		return use_eclock;
+
+	/* MICROHZ for timer_sleep_us(), any unit can read the EClock */
+	if (OpenDevice(TIMERNAME, UNIT_MICROHZ, (struct IORequest *)&timer_req, 0))
+		return 0;
+
+	TimerBase = timer_req.tr_node.io_Device;
+
+	/* ReadEClock needs 2.0 */
+	if (TimerBase->dd_Library.lib_Version < 36)
+		return 0;
+
+	/* 16.16 fixed point microseconds per tick, by long division as
+	   1000000 << 16 does not fit in 32 bits */
+	freq = ReadEClock(&ev);
+	us_int = 1000000ul / freq;
+	rem = 1000000ul % freq;
+	us_frac = 0;
+	for (i = 0; i < 16; i++) {
+		rem <<= 1;
+		us_frac <<= 1;
+		if (rem >= freq) {
+			rem -= freq;
+			us_frac |= 1;
+		}
+	}
+
+	use_eclock = 1;
+	return 1;
+}
+
+void timer_shutdown(void)
+{
+	if (TimerBase) {
+		CloseDevice((struct IORequest *)&timer_req);
+		TimerBase = NULL;
+		use_eclock = 0;
+	}
+}
+
+uint32_t timer_get_us(void)
+{
+	struct EClockVal ev;
+	uint32_t us;
+
+	if (!use_eclock)
+		return timer_get_tick_count() * (1000000ul / TIMER_TICK_FREQ);
+
+	/* Low 32 bits of the 64-bit EClock count times the 16.16 scale,
+	   in pieces that each fit in a 32-bit product */
+	ReadEClock(&ev);
+	us = ev.ev_lo * us_int;
+	us += (ev.ev_hi * us_frac) << 16;
+	us += (ev.ev_lo >> 16) * us_frac;
+	us += ((ev.ev_lo & 0xffff) * us_frac) >> 16;
+	return us;
+}
+
+void timer_delay_us(uint32_t us)
+{
+	uint32_t start = timer_get_us();
+
+	while (timer_get_us() - start < us) {
+
+	}
+}
+
+void timer_sleep_us(uint32_t us)
+{
+	struct timerequest req;
+	struct MsgPort port;
+	BYTE sig;
+
+	/* Spin before timer_init() or when waiting would break the caller's
+	   Forbid() or Disable() */
+	if (!TimerBase || SysBase->TDNestCnt >= 0 || SysBase->IDNestCnt >= 0) {
+		timer_delay_us(us);
+		return;
+	}
+
+	sig = AllocSignal(-1);
+	if (sig < 0) {
+		timer_delay_us(us);
+		return;
+	}
+
+	port.mp_Node.ln_Type = NT_MSGPORT;
+	port.mp_Flags = PA_SIGNAL;
+	port.mp_SigBit = sig;
+	port.mp_SigTask = FindTask(NULL);
+	NewList(&port.mp_MsgList);
+
+	/* A copy of the opened request on a port of the calling task */
+	req = timer_req;
+	req.tr_node.io_Message.mn_ReplyPort = &port;
+	req.tr_node.io_Command = TR_ADDREQUEST;
+	req.tr_time.tv_secs = us / 1000000ul;
+	req.tr_time.tv_micro = us % 1000000ul;
+	DoIO((struct IORequest *)&req);
+
+	FreeSignal(sig);
+}
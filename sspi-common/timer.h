@@ -48,4 +48,32 @@
 uint32_t timer_get_tick_count(void);
 void timer_delay(uint32_t ticks);
 
+/*!
+ * Opens timer.device for the microsecond timebase (EClock, needs 2.0)
+ * and timer_sleep_us(). Without the EClock timer_get_us() counts in TOD
+ * ticks.
+ *
+ * \return				1 if the EClock is used, 0 if not
+ */
+int timer_init(void);
+void timer_shutdown(void);
+
+/*!
+ * Returns a free running 32-bit microsecond counter, it wraps
+ * after about 71 minutes so only compare differences
+ *
+ * \return				Current time in us
+ */
+uint32_t timer_get_us(void);
+
+/*! Waits (spinning) for at least <us> microseconds */
+void timer_delay_us(uint32_t us);
+
+/*!
+ * Waits for at least <us> microseconds, letting other tasks run. Spins
+ * like timer_delay_us() before timer_init() and under Forbid() or
+ * Disable(). Not for use from interrupts.
+ */
+void timer_sleep_us(uint32_t us);
+
 #endif /* TIMER_H_ */
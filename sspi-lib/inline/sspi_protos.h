@@ -0,0 +1,104 @@
+#ifndef _VBCCINLINE_SSPI_H
+#define _VBCCINLINE_SSPI_H
+
+#ifndef EXEC_TYPES_H
+#include <exec/types.h>
+#endif
+
+int __spi_initialize(__reg("a6") struct Library *, __reg("d0") unsigned char channel)="\tjsr\t-30(a6)";
+#define spi_initialize(channel) __spi_initialize(SSPIBase, (channel))
+
+void __spi_shutdown(__reg("a6") struct Library *)="\tjsr\t-36(a6)";
+#define spi_shutdown() __spi_shutdown(SSPIBase)
+
+void __spi_set_speed(__reg("a6") struct Library *, __reg("d0") long speed)="\tjsr\t-42(a6)";
+#define spi_set_speed(speed) __spi_set_speed(SSPIBase, (speed))
+
+void __spi_set_trailing_clocks(__reg("a6") struct Library *, __reg("d0") UBYTE bytes)="\tjsr\t-48(a6)";
+#define spi_set_trailing_clocks(bytes) __spi_set_trailing_clocks(SSPIBase, (bytes))
+
+void __spi_obtain(__reg("a6") struct Library *)="\tjsr\t-54(a6)";
+#define spi_obtain() __spi_obtain(SSPIBase)
+
+int __spi_try_obtain(__reg("a6") struct Library *)="\tjsr\t-60(a6)";
+#define spi_try_obtain() __spi_try_obtain(SSPIBase)
+
+void __spi_release(__reg("a6") struct Library *)="\tjsr\t-66(a6)";
+#define spi_release() __spi_release(SSPIBase)
+
+void __spi_set_free_signal(__reg("a6") struct Library *, __reg("a0") struct Task *task, __reg("d0") ULONG sigmask)="\tjsr\t-72(a6)";
+#define spi_set_free_signal(task, sigmask) __spi_set_free_signal(SSPIBase, (task), (sigmask))
+
+void __spi_select(__reg("a6") struct Library *)="\tjsr\t-78(a6)";
+#define spi_select() __spi_select(SSPIBase)
+
+void __spi_deselect(__reg("a6") struct Library *)="\tjsr\t-84(a6)";
+#define spi_deselect() __spi_deselect(SSPIBase)
+
+void __spi_deselect_lazy(__reg("a6") struct Library *)="\tjsr\t-90(a6)";
+#define spi_deselect_lazy() __spi_deselect_lazy(SSPIBase)
+
+void __spi_read(__reg("a6") struct Library *, __reg("a0") unsigned char *buf, __reg("d0") UWORD size)="\tjsr\t-96(a6)";
+#define spi_read(buf, size) __spi_read(SSPIBase, (buf), (size))
+
+void __spi_write(__reg("a6") struct Library *, __reg("a0") const unsigned char *buf, __reg("d0") UWORD size)="\tjsr\t-102(a6)";
+#define spi_write(buf, size) __spi_write(SSPIBase, (buf), (size))
+
+UWORD __spi_read_blocks(__reg("a6") struct Library *, __reg("a0") unsigned char *buf, __reg("d0") UWORD count, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token)="\tjsr\t-108(a6)";
+#define spi_read_blocks(buf, count, crc, token) __spi_read_blocks(SSPIBase, (buf), (count), (crc), (token))
+
+UWORD __spi_read_csum(__reg("a6") struct Library *, __reg("a0") unsigned char *buf, __reg("d0") UWORD size)="\tjsr\t-114(a6)";
+#define spi_read_csum(buf, size) __spi_read_csum(SSPIBase, (buf), (size))
+
+void __spi_clock(__reg("a6") struct Library *, __reg("d0") UWORD size)="\tjsr\t-120(a6)";
+#define spi_clock(size) __spi_clock(SSPIBase, (size))
+
+void __spi_skip(__reg("a6") struct Library *, __reg("d0") UWORD size)="\tjsr\t-126(a6)";
+#define spi_skip(size) __spi_skip(SSPIBase, (size))
+
+UBYTE __spi_scan(__reg("a6") struct Library *, __reg("d0") UWORD polls)="\tjsr\t-132(a6)";
+#define spi_scan(polls) __spi_scan(SSPIBase, (polls))
+
+void __spi_command(__reg("a6") struct Library *, __reg("a0") const unsigned char *tx, __reg("d0") UWORD txsize, __reg("a1") unsigned char *rx, __reg("d1") UWORD rxsize)="\tjsr\t-138(a6)";
+#define spi_command(tx, txsize, rx, rxsize) __spi_command(SSPIBase, (tx), (txsize), (rx), (rxsize))
+
+void __spi_read_2(__reg("a6") struct Library *, __reg("a0") unsigned char *buf)="\tjsr\t-144(a6)";
+#define spi_read_2(buf) __spi_read_2(SSPIBase, (buf))
+
+void __spi_read_6(__reg("a6") struct Library *, __reg("a0") unsigned char *buf)="\tjsr\t-150(a6)";
+#define spi_read_6(buf) __spi_read_6(SSPIBase, (buf))
+
+void __spi_read_14(__reg("a6") struct Library *, __reg("a0") unsigned char *buf)="\tjsr\t-156(a6)";
+#define spi_read_14(buf) __spi_read_14(SSPIBase, (buf))
+
+void __spi_read_512(__reg("a6") struct Library *, __reg("a0") unsigned char *buf)="\tjsr\t-162(a6)";
+#define spi_read_512(buf) __spi_read_512(SSPIBase, (buf))
+
+void __spi_write_2(__reg("a6") struct Library *, __reg("a0") const unsigned char *buf)="\tjsr\t-168(a6)";
+#define spi_write_2(buf) __spi_write_2(SSPIBase, (buf))
+
+void __spi_write_6(__reg("a6") struct Library *, __reg("a0") const unsigned char *buf)="\tjsr\t-174(a6)";
+#define spi_write_6(buf) __spi_write_6(SSPIBase, (buf))
+
+void __spi_write_512(__reg("a6") struct Library *, __reg("a0") const unsigned char *buf)="\tjsr\t-180(a6)";
+#define spi_write_512(buf) __spi_write_512(SSPIBase, (buf))
+
+void __spi_set_priority(__reg("a6") struct Library *, __reg("d0") BYTE priority)="\tjsr\t-186(a6)";
+#define spi_set_priority(priority) __spi_set_priority(SSPIBase, (priority))
+
+void __spi_set_max_hold(__reg("a6") struct Library *, __reg("d0") ULONG us)="\tjsr\t-192(a6)";
+#define spi_set_max_hold(us) __spi_set_max_hold(SSPIBase, (us))
+
+int __spi_yield(__reg("a6") struct Library *)="\tjsr\t-198(a6)";
+#define spi_yield() __spi_yield(SSPIBase)
+
+const struct sspi_stats_TYPE *__spi_get_stats(__reg("a6") struct Library *, __reg("d0") unsigned char channel)="\tjsr\t-204(a6)";
+#define spi_get_stats(channel) __spi_get_stats(SSPIBase, (channel))
+
+const char *__spi_get_kernel_name(__reg("a6") struct Library *)="\tjsr\t-210(a6)";
+#define spi_get_kernel_name() __spi_get_kernel_name(SSPIBase)
+
+int __spi_yield_due(__reg("a6") struct Library *)="\tjsr\t-216(a6)";
+#define spi_yield_due() __spi_yield_due(SSPIBase)
+
+#endif /*  _VBCCINLINE_SSPI_H  */
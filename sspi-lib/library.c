@@ -0,0 +1,180 @@
+/*  SPI library for the Simple SPI controller
+ *
+ *  sspi.library, spi-lib as a shared library so all drivers use one copy
+ *  of the kernels and bus state
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <exec/types.h>
+#include <exec/execbase.h>
+#include <exec/libraries.h>
+#include <proto/exec.h>
+#include <string.h>
+#include "spi.h"
+#include "sspi_base.h"
+#include "timer.h"
+
+#ifndef SSPI_LIBRARY
+#error "build sspi.library with -DSSPI_LIBRARY"
+#endif
+
+#define LIBRARY_ID_STRING		"sspi.library 1.0 (19 October 2026)"
+#define LIBRARY_REVISION		0
+
+struct ExecBase *SysBase;
+
+char library_name[] = SSPI_LIBRARY_NAME;
+char id_string[] = LIBRARY_ID_STRING;
+
+static struct sspi_base_TYPE *init_library(__reg("a6") struct ExecBase *sys_base, __reg("a0") BPTR seg_list, __reg("d0") struct sspi_base_TYPE *base)
+{
+	SysBase = *(struct ExecBase **)4;
+
+	base->lib.lib_Node.ln_Type = NT_LIBRARY;
+	base->lib.lib_Node.ln_Name = library_name;
+	base->lib.lib_Flags = LIBF_SUMUSED | LIBF_CHANGED;
+	base->lib.lib_Version = SSPI_LIBRARY_VERSION;
+	base->lib.lib_Revision = LIBRARY_REVISION;
+	base->lib.lib_IdString = (APTR)id_string;
+	base->master = NULL;
+	base->seg_list = seg_list;
+
+	return base;
+}
+
+static BPTR expunge(__reg("a6") struct sspi_base_TYPE *base)
+{
+	BPTR seg_list;
+
+	//RemLibrary() calls the library in the system list, close calls
+	//with the master
+	if(base->master)
+		base = base->master;
+
+	if(base->lib.lib_OpenCnt != 0)
+	{
+		base->lib.lib_Flags |= LIBF_DELEXP;
+		return 0;
+	}
+
+	timer_shutdown();
+
+	seg_list = base->seg_list;
+	Remove(&base->lib.lib_Node);
+	FreeMem((char *)base - base->lib.lib_NegSize, base->lib.lib_NegSize + base->lib.lib_PosSize);
+	return seg_list;
+}
+
+//every opener gets a copy of the jump table and base, so the calls find
+//their own context in a6 and drivers need no handle of their own
+static struct sspi_base_TYPE *open(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") ULONG version)
+{
+	ULONG size = base->lib.lib_NegSize + base->lib.lib_PosSize;
+	struct sspi_base_TYPE *copy;
+	char *mem;
+
+	mem = AllocMem(size, MEMF_PUBLIC);
+	if(mem == NULL)
+		return NULL;
+
+	memcpy(mem, (char *)base - base->lib.lib_NegSize, size);
+	copy = (struct sspi_base_TYPE *)(mem + base->lib.lib_NegSize);
+
+	//the copied jump table is code
+	if(SysBase->LibNode.lib_Version >= 37)
+		CacheClearU();
+
+	copy->master = base;
+	copy->lib.lib_OpenCnt = 1;
+	memset(&copy->context, 0, sizeof(copy->context));
+	copy->context.chan = &copy->context.local_channel;
+
+	base->lib.lib_OpenCnt++;
+	base->lib.lib_Flags &= ~LIBF_DELEXP;
+
+	return copy;
+}
+
+static BPTR close(__reg("a6") struct sspi_base_TYPE *base)
+{
+	struct sspi_base_TYPE *master = base->master;
+
+	//give the bus back if the opener still has it
+	spi_shutdown(base);
+
+	FreeMem((char *)base - base->lib.lib_NegSize, base->lib.lib_NegSize + base->lib.lib_PosSize);
+
+	master->lib.lib_OpenCnt--;
+
+	if(master->lib.lib_OpenCnt == 0 && (master->lib.lib_Flags & LIBF_DELEXP))
+		return expunge(master);
+
+	return 0;
+}
+
+static ULONG null_function(void)
+{
+	return 0;
+}
+
+//order is the LVO order of sspi_lib.fd
+static ULONG library_vectors[] =
+{
+	(ULONG)open,
+	(ULONG)close,
+	(ULONG)expunge,
+	(ULONG)null_function,
+	(ULONG)spi_initialize,
+	(ULONG)spi_shutdown,
+	(ULONG)spi_set_speed,
+	(ULONG)spi_set_trailing_clocks,
+	(ULONG)spi_obtain,
+	(ULONG)spi_try_obtain,
+	(ULONG)spi_release,
+	(ULONG)spi_set_free_signal,
+	(ULONG)spi_select,
+	(ULONG)spi_deselect,
+	(ULONG)spi_deselect_lazy,
+	(ULONG)spi_read,
+	(ULONG)spi_write,
+	(ULONG)spi_read_blocks,
+	(ULONG)spi_read_csum,
+	(ULONG)spi_clock,
+	(ULONG)spi_skip,
+	(ULONG)spi_scan,
+	(ULONG)spi_command,
+	(ULONG)spi_read_2,
+	(ULONG)spi_read_6,
+	(ULONG)spi_read_14,
+	(ULONG)spi_read_512,
+	(ULONG)spi_write_2,
+	(ULONG)spi_write_6,
+	(ULONG)spi_write_512,
+	(ULONG)spi_set_priority,
+	(ULONG)spi_set_max_hold,
+	(ULONG)spi_yield,
+	(ULONG)spi_get_stats,
+	(ULONG)spi_get_kernel_name,
+	(ULONG)spi_yield_due,
+	-1,
+};
+
+ULONG auto_init_tables[] =
+{
+	sizeof(struct sspi_base_TYPE),
+	(ULONG)library_vectors,
+	0,
+	(ULONG)init_library,
+};
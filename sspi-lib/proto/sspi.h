@@ -0,0 +1,12 @@
+#ifndef _PROTO_SSPI_H
+#define _PROTO_SSPI_H
+
+#ifndef EXEC_TYPES_H
+#include <exec/types.h>
+#endif
+
+extern struct Library *SSPIBase;
+
+#include <inline/sspi_protos.h>
+
+#endif
@@ -0,0 +1,25 @@
+RTC_MATCHWORD:	equ	$4afc
+RTF_AUTOINIT:	equ	(1<<7)
+RTF_COLDSTART:	equ	(1<<0)
+NT_LIBRARY:	equ	9
+VERSION:		equ   1
+; above sspisd.device so the library is there when it opens it
+PRIORITY:	equ	11
+
+		section	code,code
+
+		moveq	#-1,d0
+		rts
+
+romtag:
+		dc.w	RTC_MATCHWORD
+		dc.l	romtag
+		dc.l	endcode
+		dc.b	RTF_AUTOINIT|RTF_COLDSTART
+		dc.b	VERSION
+		dc.b	NT_LIBRARY
+		dc.b	PRIORITY
+		dc.l	_library_name
+		dc.l	_id_string
+		dc.l	_auto_init_tables
+endcode:
@@ -19,122 +19,628 @@
  
 
 #include "spi.h"
+#include "sspi_base.h"
+#include "timer.h"
 #include <proto/exec.h>
 #include <string.h>
 
 //assembly functions
 extern void spi_read_fast(__reg("a0") UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
 extern void spi_write_fast(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern UWORD spi_read_blocks_fast(__reg("a0") UBYTE *buf, __reg("d0") UWORD count, __reg("a1") UBYTE *port, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token);
+extern void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port, __reg("d1") UWORD delay);
+extern void spi_write_slow(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port, __reg("d1") UWORD delay);
+extern void spi_delay(__reg("d0") UWORD loops);
+extern void spi_read_fast_020(__reg("a0") UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern void spi_write_fast_020(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern void spi_clock_fast(__reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern void spi_skip_fast(__reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern UBYTE spi_scan_fast(__reg("d0") UWORD polls, __reg("a1") UBYTE *port);
+extern ULONG spi_read_csum_fast(__reg("a0") UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+extern void spi_read_2_fast(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_read_6_fast(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_read_14_fast(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_read_512_fast(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_write_2_fast(__reg("a0") const UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_write_6_fast(__reg("a0") const UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_write_512_fast(__reg("a0") const UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_read_512_fast_020(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+extern void spi_write_512_fast_020(__reg("a0") const UBYTE *buf, __reg("a1") UBYTE *port);
+extern UWORD spi_read_blocks_fast_020(__reg("a0") UBYTE *buf, __reg("d0") UWORD count, __reg("a1") UBYTE *port, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token);
 
-//current speed setting
-static long current_speed = SPI_SPEED_SLOW;
+//fast speed kernels for a CPU class
+struct spi_kernels_TYPE
+{
+	const char *name;
+	void (*read)(__reg("a0") UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+	void (*write)(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size, __reg("a1") UBYTE *port);
+	void (*read_512)(__reg("a0") UBYTE *buf, __reg("a1") UBYTE *port);
+	void (*write_512)(__reg("a0") const UBYTE *buf, __reg("a1") UBYTE *port);
+	UWORD (*read_blocks)(__reg("a0") UBYTE *buf, __reg("d0") UWORD count, __reg("a1") UBYTE *port, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token);
+};
+
+static const struct spi_kernels_TYPE kernels_000 = { "68000", spi_read_fast, spi_write_fast, spi_read_512_fast, spi_write_512_fast, spi_read_blocks_fast };
+static const struct spi_kernels_TYPE kernels_020 = { "68020", spi_read_fast_020, spi_write_fast_020, spi_read_512_fast_020, spi_write_512_fast_020, spi_read_blocks_fast_020 };
+
+//kernels in use, chosen by spi_initialize
+static const struct spi_kernels_TYPE *kernels = &kernels_000;
+
+//slow speed bit time, 250kHz
+#define SLOW_BIT_NS			4000
+
+//calibration: delay loops and bytes per measurement step
+#define CAL_LOOPS			1000
+#define CAL_BYTES			16
+
+#ifdef SSPI_LIBRARY
+//every opener of sspi.library has its own library base with its context,
+//the library calls get it in a6
+#define SPI_BASE		__reg("a6") struct sspi_base_TYPE *base
+#define SPI_BASE_		SPI_BASE,
+#define SPI_ARG			base
+#define SPI_ARG_		base,
+#define SPI_CTX			(&base->context)
+#else
+//linked into a driver there is just the one context
+static struct spi_context_TYPE context = { 0, &context.local_channel, { SPI_SPEED_SLOW } };
 
-//SPI channel (chip_select) to use
-static long current_channel = 0;
+#define SPI_BASE		void
+#define SPI_BASE_
+#define SPI_ARG
+#define SPI_ARG_
+#define SPI_CTX			(&context)
+#endif
 
-//pointer to CIAA register
-static volatile UBYTE *cia_b_pra = (volatile UBYTE *)0xbfd000;
+//resource has the version 3 channel records and chip select state
+static UBYTE shared_state;
+
+//delay loops per bit at slow speed, in the resource when it has room for it
+static UWORD local_slow_delay;
+static UWORD *slow_delay = &local_slow_delay;
 
 //pointer to the SSPI resource
 struct sspi_resource_TYPE *sspi;
 
-//bus status
-UBYTE bus_taken;
+//resource has the version 2 arbiter fields
+static UBYTE arbiter;
+
+//resource has the version 5 bus free notification
+static UBYTE notifier;
+
 
-//obtain the bus
-void spi_obtain()
+//obtain the bus, waiting channels are flagged so the holder can hand
+//the bus over in spi_yield
+static void obtain_bus(SPI_BASE)
 {
-	if(!bus_taken)
+	struct spi_context_TYPE *ctx = SPI_CTX;
+	struct sspi_stats_TYPE *stats;
+	ULONG start, wait;
+
+	if(!arbiter)
 	{
-		ObtainSemaphore(&sspi->semaphore);	
-		bus_taken = 1;
+		ObtainSemaphore(&sspi->semaphore);
+		return;
 	}
+
+	stats = &sspi->stats[ctx->channel-1];
+	stats->obtains++;
+
+	if(AttemptSemaphore(&sspi->semaphore))
+	{
+		ctx->obtained_at = timer_get_us();
+		return;
+	}
+
+	start = timer_get_us();
+	Forbid();
+	sspi->waiting |= ctx->channel;
+	Permit();
+
+	ObtainSemaphore(&sspi->semaphore);
+
+	Forbid();
+	sspi->waiting &= ~ctx->channel;
+	Permit();
+
+	ctx->obtained_at = timer_get_us();
+	wait = ctx->obtained_at - start;
+	stats->contended++;
+	stats->wait_us += wait;
+	if(wait > stats->max_wait_us)
+		stats->max_wait_us = wait;
+}
+
+//signal the other channel if it failed spi_try_obtain while we had the bus
+static void notify_free(SPI_BASE)
+{
+	UBYTE other = SPI_CTX->channel ^ (SPI_CHANNEL_1|SPI_CHANNEL_2);
+	struct Task *task;
+
+	if(!notifier || !(sspi->notify & other))
+		return;
+
+	Forbid();
+	sspi->notify &= ~other;
+	task = sspi->free_task[other-1];
+	if(task)
+		Signal(task, sspi->free_signal[other-1]);
+	Permit();
 }
 
-//release the bus
-void spi_release()
+//obtain the bus, calls nest and the bus is released by the last spi_release
+void spi_obtain(SPI_BASE)
 {
-	if(bus_taken)
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	if(!ctx->bus_taken)
+		obtain_bus(SPI_ARG);
+	ctx->bus_taken++;
+}
+
+//obtain the bus only if that does not mean waiting, returns 1 if we have
+//it (spi_release it as usual) and 0 if another channel holds it. In that
+//case the signal set with spi_set_free_signal is sent when it is released.
+int spi_try_obtain(SPI_BASE)
+{
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	if(!ctx->bus_taken)
+	{
+		if(!AttemptSemaphore(&sspi->semaphore))
+		{
+			if(!notifier)
+				return 0;
+
+			Forbid();
+			sspi->notify |= ctx->channel;
+			Permit();
+
+			//the holder may have released the bus before it saw our flag
+			if(!AttemptSemaphore(&sspi->semaphore))
+				return 0;
+
+			Forbid();
+			sspi->notify &= ~ctx->channel;
+			Permit();
+		}
+
+		if(arbiter)
+		{
+			sspi->stats[ctx->channel-1].obtains++;
+			ctx->obtained_at = timer_get_us();
+		}
+	}
+
+	ctx->bus_taken++;
+	return 1;
+}
+
+//set the task and signal that spi_try_obtain wants to see when the bus is
+//free again, NULL for none
+void spi_set_free_signal(SPI_BASE_ __reg("a0") struct Task *task, __reg("d0") ULONG sigmask)
+{
+	if(notifier)
+	{
+		Forbid();
+		sspi->free_task[SPI_CTX->channel-1] = task;
+		sspi->free_signal[SPI_CTX->channel-1] = sigmask;
+		Permit();
+	}
+}
+
+//release the bus when this is the last nested call, a pending lazy deselect
+//is done first
+void spi_release(SPI_BASE)
+{
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	if(ctx->bus_taken && --ctx->bus_taken == 0)
 	{
+		if(ctx->deselect_pending)
+			spi_deselect(SPI_ARG);
+
 		ReleaseSemaphore(&sspi->semaphore);
-		bus_taken = 0;
+		notify_free(SPI_ARG);
 	}
 }
 
-//select the channel (assert chip_select)
-void spi_select()
+//drive chip select <cs>, returns 0 if the controller already did
+static int set_cs(UBYTE cs)
 {
 	UBYTE *csport = (UBYTE *)SSPI_BASE_ADDRESS;
-		
-	//assert chipselect
-	*csport = current_channel;	
+
+	//without the shared state we cannot know what the controller does
+	if(shared_state)
+	{
+		if(sspi->cs_state == cs)
+			return 0;
+		sspi->cs_state = cs;
+	}
+
+	*csport = cs;
+	return 1;
 }
 
-//deselect the channel (de-assert chip_select)
-void spi_deselect()
+//select the channel (assert chip_select), after spi_deselect_lazy the
+//chip select simply stays asserted
+void spi_select(SPI_BASE)
 {
-	UBYTE *csport = (UBYTE *)SSPI_BASE_ADDRESS;
-		
-	//de-assert chipselect
-	*csport = 0;
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	ctx->deselect_pending = 0;
+	set_cs(ctx->chan->cs);
 }
 
-//sets the speed of the SPI bus
-void spi_set_speed(long speed)
+//deselect the channel (de-assert chip_select), followed by the trailing
+//clocks the channel needs
+void spi_deselect(SPI_BASE)
 {
-	current_speed = speed;
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	ctx->deselect_pending = 0;
+	if(set_cs(0))
+		spi_clock(SPI_ARG_ ctx->chan->trailing_clocks);
 }
 
+//end a transaction without a chip select edge: the chip select stays
+//asserted until the next spi_select (no edge at all), spi_deselect or
+//spi_release. For devices that do not need the edge between transactions.
+void spi_deselect_lazy(SPI_BASE)
+{
+	SPI_CTX->deselect_pending = 1;
+}
 
-// A slow SPI transfer takes 32 us (8 bits times 4us (250kHz))
-// An E-cycle is 1.4 us.
-static void wait_40_us()
+//sets the speed of the SPI bus
+void spi_set_speed(SPI_BASE_ __reg("d0") long speed)
 {
-	UBYTE tmp;
-	for (int i = 0; i < 32; i++)
-		tmp = *cia_b_pra;
+	SPI_CTX->chan->speed = speed;
 }
 
-//slowed down write
-static void spi_write_slow(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size)
+//sets the number of bytes clocked out after deselecting the channel,
+//SD cards only release MISO after 8 more clocks
+void spi_set_trailing_clocks(SPI_BASE_ __reg("d0") UBYTE bytes)
 {
-	for (ULONG i = 0; i < size; i++)
+	SPI_CTX->chan->trailing_clocks = bytes;
+}
+
+
+//time in ns of one delay loop iteration (<bytes> = 0) or of one bit read
+//at slow speed without delay, best of <runs> runs of at least <run_us>.
+//Runs start on a change of the timer, so with the 20ms TOD fallback the
+//measured time is never longer than the real one.
+static ULONG measure_ns(UWORD bytes, ULONG run_us, int runs)
+{
+	UBYTE buf[CAL_BYTES];
+	ULONG start, elapsed, units, ns, best = 0xffffffff;
+
+	while(runs--)
 	{
-		spi_write_fast(buf++, 1, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+		start = timer_get_us();
+		while(timer_get_us() == start)
+			;
+		start = timer_get_us();
+		units = 0;
+
+		do
+		{
+			if(bytes)
+			{
+				spi_read_slow(buf, bytes, (UBYTE *)(SSPI_BASE_ADDRESS+1), 0);
+				units += bytes * 8;
+			}
+			else
+			{
+				spi_delay(CAL_LOOPS);
+				units += CAL_LOOPS + 1;
+			}
+			elapsed = timer_get_us() - start;
+		}
+		while(elapsed < run_us);
+
+		ns = elapsed * 1000 / units;
+		if(ns < best)
+			best = ns;
 	}
+
+	return best;
 }
 
-//slowed down read
-static void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") UWORD size)
-{	
-	for (ULONG i = 0; i < size; i++)
+//work out the delay loops per bit that make a slow speed bit take at least
+//SLOW_BIT_NS on this CPU, the bus is clocked with no chip select asserted
+static void calibrate_slow(SPI_BASE)
+{
+	ULONG run_us, loop_ns, bit_ns;
+	int runs;
+
+	//short runs with the EClock, the best one has the fewest interrupts
+	if(timer_init())
+	{
+		run_us = 2000;
+		runs = 8;
+	}
+	else
 	{
-		spi_read_fast(buf++, 1, (UBYTE *)(SSPI_BASE_ADDRESS+1));
-		wait_40_us();
+		run_us = 60000;
+		runs = 1;
 	}
+
+	spi_obtain(SPI_ARG);
+	set_cs(0);
+	loop_ns = measure_ns(0, run_us, runs);
+	bit_ns = measure_ns(CAL_BYTES, run_us, runs);
+	spi_release(SPI_ARG);
+
+	if(loop_ns == 0)
+		loop_ns = 1;
+
+	*slow_delay = bit_ns < SLOW_BIT_NS ? (SLOW_BIT_NS - bit_ns + loop_ns - 1) / loop_ns : 0;
 }
 
 //read <size> bytes from the SPI bus into <buf>
-void spi_read(__reg("a0") UBYTE *buf, __reg("d0") UWORD size)
+void spi_read(SPI_BASE_ __reg("a0") UBYTE *buf, __reg("d0") UWORD size)
 {
-	if (current_speed == SPI_SPEED_FAST)
-		spi_read_fast(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		kernels->read(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
 	else
-		spi_read_slow(buf, size);
+		spi_read_slow(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1), *slow_delay);
 }
 
 //write <size> bytes from <buf> to the SPI bus
-void spi_write(__reg("a0") const UBYTE *buf, __reg("d0") UWORD size)
+void spi_write(SPI_BASE_ __reg("a0") const UBYTE *buf, __reg("d0") UWORD size)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		kernels->write(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_write_slow(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1), *slow_delay);
+}
+
+//read 2 bytes into <buf>, unrolled in fast mode when <buf> is even
+void spi_read_2(SPI_BASE_ __reg("a0") UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST && !((ULONG)buf & 1))
+		spi_read_2_fast(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_read(SPI_ARG_ buf, 2);
+}
+
+//read 6 bytes into <buf>, unrolled in fast mode when <buf> is even
+void spi_read_6(SPI_BASE_ __reg("a0") UBYTE *buf)
 {
-	if (current_speed == SPI_SPEED_FAST)
-		spi_write_fast(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST && !((ULONG)buf & 1))
+		spi_read_6_fast(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
 	else
-		spi_write_slow(buf, size);
+		spi_read(SPI_ARG_ buf, 6);
+}
+
+//read 14 bytes into <buf>, unrolled in fast mode when <buf> is even
+void spi_read_14(SPI_BASE_ __reg("a0") UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST && !((ULONG)buf & 1))
+		spi_read_14_fast(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_read(SPI_ARG_ buf, 14);
+}
+
+//read 512 bytes into <buf>, unrolled in fast mode when <buf> is even
+void spi_read_512(SPI_BASE_ __reg("a0") UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST && !((ULONG)buf & 1))
+		kernels->read_512(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_read(SPI_ARG_ buf, 512);
+}
+
+//write 2 bytes from <buf>, unrolled in fast mode
+void spi_write_2(SPI_BASE_ __reg("a0") const UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		spi_write_2_fast(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_write(SPI_ARG_ buf, 2);
+}
+
+//write 6 bytes from <buf>, unrolled in fast mode
+void spi_write_6(SPI_BASE_ __reg("a0") const UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		spi_write_6_fast(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_write(SPI_ARG_ buf, 6);
+}
+
+//write 512 bytes from <buf>, unrolled in fast mode
+void spi_write_512(SPI_BASE_ __reg("a0") const UBYTE *buf)
+{
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		kernels->write_512(buf, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		spi_write(SPI_ARG_ buf, 512);
+}
+
+//read <size> bytes from the SPI bus into <buf> and return their ones
+//complement sum as big endian 16 bit words (not inverted), an odd last
+//byte counts as the high byte of a word
+UWORD spi_read_csum(SPI_BASE_ __reg("a0") UBYTE *buf, __reg("d0") UWORD size)
+{
+	ULONG sum = 0;
+	UWORD i;
+
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST && !((ULONG)buf & 1))
+		sum = spi_read_csum_fast(buf, size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+	{
+		spi_read(SPI_ARG_ buf, size);
+		for(i = 1; i < size; i += 2)
+			sum += ((UWORD)buf[i-1] << 8) | buf[i];
+		if(size & 1)
+			sum += (UWORD)buf[size-1] << 8;
+	}
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (UWORD)sum;
+}
+
+//clock out <size> 0xff bytes
+void spi_clock(SPI_BASE_ __reg("d0") UWORD size)
+{
+	UBYTE ff = 0xff;
+
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		spi_clock_fast(size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		while(size--)
+			spi_write_slow(&ff, 1, (UBYTE *)(SSPI_BASE_ADDRESS+1), *slow_delay);
+}
+
+//clock in <size> bytes and discard them
+void spi_skip(SPI_BASE_ __reg("d0") UWORD size)
+{
+	UBYTE dummy;
+
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		spi_skip_fast(size, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+	else
+		while(size--)
+			spi_read_slow(&dummy, 1, (UBYTE *)(SSPI_BASE_ADDRESS+1), *slow_delay);
+}
+
+//clock in up to <polls> bytes until one is not 0xff and return it,
+//returns 0xff if all of them were
+UBYTE spi_scan(SPI_BASE_ __reg("d0") UWORD polls)
+{
+	UBYTE in = 0xff;
+
+	if (SPI_CTX->chan->speed == SPI_SPEED_FAST)
+		return spi_scan_fast(polls, (UBYTE *)(SSPI_BASE_ADDRESS+1));
+
+	while(polls-- && in == 0xff)
+		spi_read_slow(&in, 1, (UBYTE *)(SSPI_BASE_ADDRESS+1), *slow_delay);
+
+	return in;
+}
+
+//a complete transaction: obtain the bus, select, write <txsize> bytes from
+//<tx>, read <rxsize> bytes into <rx>, deselect and release. One call instead
+//of five for short command/response exchanges.
+void spi_command(SPI_BASE_ __reg("a0") const UBYTE *tx, __reg("d0") UWORD txsize, __reg("a1") UBYTE *rx, __reg("d1") UWORD rxsize)
+{
+	spi_obtain(SPI_ARG);
+	spi_select(SPI_ARG);
+	if(txsize)
+		spi_write(SPI_ARG_ tx, txsize);
+	if(rxsize)
+		spi_read(SPI_ARG_ rx, rxsize);
+	spi_deselect(SPI_ARG);
+	spi_release(SPI_ARG);
+}
+
+//stream <count> 512 byte SD data blocks (token, data and CRC) into <buf>
+//the received CRC of each block is stored in <crc> unless it is NULL
+//returns the number of blocks that were not read, the caller should receive
+//those itself (slow speed, error token or a late start token). An error
+//token has been clocked in already, it is stored in <token> (0xff for none)
+UWORD spi_read_blocks(SPI_BASE_ __reg("a0") UBYTE *buf, __reg("d0") UWORD count, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token)
+{
+	if (token)
+		*token = 0xff;
+
+	if (SPI_CTX->chan->speed != SPI_SPEED_FAST)
+		return count;
+		
+	return kernels->read_blocks(buf, count, (UBYTE *)(SSPI_BASE_ADDRESS+1), crc, token);
+}
+
+//set the bus priority of our channel, a waiting channel with a higher
+//priority gets the bus at the next spi_yield of the holder
+void spi_set_priority(SPI_BASE_ __reg("d0") BYTE priority)
+{
+	if(arbiter)
+		sspi->priority[SPI_CTX->channel-1] = priority;
+}
+
+//set the time after which spi_yield hands the bus over to any waiting
+//channel, 0 means no limit
+void spi_set_max_hold(SPI_BASE_ __reg("d0") ULONG us)
+{
+	if(arbiter)
+		sspi->max_hold_us[SPI_CTX->channel-1] = us;
+}
+
+//returns 1 if another channel is waiting for the bus (or failed to get it
+//with spi_try_obtain) and either has a higher priority or we held the bus for
+//longer than our maximum hold time.
+int spi_yield_due(SPI_BASE)
+{
+	struct spi_context_TYPE *ctx = SPI_CTX;
+	UBYTE other = ctx->channel ^ (SPI_CHANNEL_1|SPI_CHANNEL_2);
+	UBYTE wanted;
+	ULONG max_hold;
+
+	if(!arbiter || !ctx->bus_taken)
+		return 0;
+
+	wanted = sspi->waiting;
+	if(notifier)
+		wanted |= sspi->notify;
+	if(!(wanted & other))
+		return 0;
+
+	max_hold = sspi->max_hold_us[ctx->channel-1];
+	if(sspi->priority[other-1] <= sspi->priority[ctx->channel-1] &&
+	   (max_hold == 0 || timer_get_us() - ctx->obtained_at < max_hold))
+		return 0;
+
+	return 1;
+}
+
+//hand the bus over when spi_yield_due says so.
+//To be called at points where the transfer can pause, the chip select is
+//deasserted (with the trailing clocks of the channel) and asserted again
+//after the bus is back. Returns 1 if the bus was handed over.
+int spi_yield(SPI_BASE)
+{
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	if(!spi_yield_due(SPI_ARG))
+		return 0;
+
+	sspi->stats[ctx->channel-1].yields++;
+
+	spi_deselect(SPI_ARG);
+	ReleaseSemaphore(&sspi->semaphore);
+	notify_free(SPI_ARG);
+
+	//semaphore ownership goes to the waiting task first, a signalled task
+	//gets it when it runs before us
+	obtain_bus(SPI_ARG);
+	spi_select(SPI_ARG);
+
+	return 1;
+}
+
+//returns the bus statistics of <channel>, NULL if the resource does not
+//keep them
+const struct sspi_stats_TYPE *spi_get_stats(SPI_BASE_ __reg("d0") unsigned char channel)
+{
+	if(!arbiter || (channel!=SPI_CHANNEL_1 && channel!=SPI_CHANNEL_2))
+		return NULL;
+
+	return &sspi->stats[channel-1];
+}
+
+//returns the name of the CPU class the fast kernels are made for
+const char *spi_get_kernel_name(SPI_BASE)
+{
+	return kernels->name;
 }
 
 //initialize SPI hardware, <channel> sets chipselect to use
-int spi_initialize(unsigned char channel)
+int spi_initialize(SPI_BASE_ __reg("d0") unsigned char channel)
 {
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
 	//assert channel
 	if(channel!=SPI_CHANNEL_1 && channel!=SPI_CHANNEL_2)
 		return -1;
@@ -156,7 +662,7 @@ int spi_initialize(unsigned char channel)
 		sspi->node.ln_Type = NT_RESOURCE;
 		sspi->node.ln_Pri = 0;
 		sspi->node.ln_Name = sspi->name;
-		sspi->Version = 1;
+		sspi->Version = SSPI_VERSION;
 		sspi->Revision = 0;
 	
 		//add resource to the system
@@ -164,22 +670,63 @@ int spi_initialize(unsigned char channel)
 	}		
 	
 	//set channel to use
-	current_channel = channel;
+	ctx->channel = channel;
+
+	//68020 and up have their own fast kernels
+	kernels = (SysBase->AttnFlags & AFF_68020) ? &kernels_020 : &kernels_000;
+
+	//a resource created by an older driver is smaller and has no arbiter
+	//or channel records
+	arbiter = sspi->Version >= 2;
+	shared_state = sspi->Version >= 3;
+	notifier = sspi->Version >= 5;
+	ctx->chan = shared_state ? &sspi->channel[channel-1] : &ctx->local_channel;
 	
 	//we do not have the bus
-	bus_taken = 0;
+	ctx->bus_taken = 0;
+	ctx->deselect_pending = 0;
 	
-	//initial speed is slow
-	current_speed = SPI_SPEED_SLOW;
+	//initial speed is slow, no trailing clocks
+	ctx->chan->cs = channel;
+	ctx->chan->speed = SPI_SPEED_SLOW;
+	ctx->chan->trailing_clocks = 0;
+
+	//calibrate slow speed once, the first driver stores it in the resource
+	if(sspi->Version >= 4)
+	{
+		slow_delay = &sspi->slow_delay;
+		if(!sspi->slow_calibrated)
+		{
+			calibrate_slow(SPI_ARG);
+			sspi->slow_calibrated = 1;
+		}
+	}
+	else
+		calibrate_slow(SPI_ARG);
 			
 	return 1;
 }
 
 //shutdown SPI bus
-void spi_shutdown()
+void spi_shutdown(SPI_BASE)
 {
-	//make sure we release the bus
-	spi_deselect();
-	spi_release();
+	struct spi_context_TYPE *ctx = SPI_CTX;
+
+	//not initialized (an opener of the library that never used the bus)
+	if(!ctx->channel)
+		return;
+
+	spi_set_free_signal(SPI_ARG_ NULL, 0);
+
+	//the chip select and the clock are only touched when we hold the bus,
+	//otherwise the other channel may be in the middle of a transfer
+	ctx->deselect_pending = 0;
+	if(ctx->bus_taken)
+	{
+		//make sure we release the bus, however deep it was obtained
+		spi_deselect(SPI_ARG);
+		ctx->bus_taken = 1;
+		spi_release(SPI_ARG);
+	}
 }
 
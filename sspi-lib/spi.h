@@ -31,6 +31,32 @@
 #define SPI_CHANNEL_2		0x02
 
 #define SSPI_RESOURCE_NAME	"sspi"
+#define SSPI_VERSION		5
+
+#define SSPI_LIBRARY_NAME	"sspi.library"
+#define SSPI_LIBRARY_VERSION	1
+
+//number of channels, per channel arrays are indexed with channel-1
+#define SSPI_CHANNELS		2
+
+//bus statistics of one channel (version 2)
+struct sspi_stats_TYPE
+{
+	ULONG obtains;			//number of times the bus was obtained
+	ULONG contended;		//number of those that had to wait
+	ULONG wait_us;			//total time spent waiting
+	ULONG max_wait_us;		//longest wait
+	ULONG yields;			//number of times the bus was handed over in spi_yield
+};
+
+//configuration of one channel (version 3)
+struct sspi_channel_TYPE
+{
+	UBYTE speed;			//SPI_SPEED_SLOW or SPI_SPEED_FAST
+	UBYTE cs;				//chip select value of the channel
+	UBYTE trailing_clocks;	//bytes clocked out after deselecting
+	UBYTE pad;
+};
 
 struct sspi_resource_TYPE
 {
@@ -43,16 +69,70 @@ struct sspi_resource_TYPE
    UWORD   Revision;	 
    struct SignalSemaphore semaphore;
 	char name[sizeof(SSPI_RESOURCE_NAME)];
+
+	//version 2 and up
+	UBYTE waiting;							//mask of channels waiting for the bus
+	BYTE priority[SSPI_CHANNELS];			//bus priority of each channel
+	ULONG max_hold_us[SSPI_CHANNELS];		//hand the bus over after this long, 0 = no limit
+	struct sspi_stats_TYPE stats[SSPI_CHANNELS];
+
+	//version 3 and up
+	UBYTE cs_state;							//chip select driven on the controller
+	UBYTE pad5;
+	struct sspi_channel_TYPE channel[SSPI_CHANNELS];
+
+	//version 4 and up
+	UWORD slow_delay;						//calibrated delay loops per bit at slow speed
+	UWORD slow_calibrated;					//slow_delay is valid
+
+	//version 5 and up
+	UBYTE notify;							//mask of channels to signal when the bus is released
+	UBYTE pad6;
+	struct Task *free_task[SSPI_CHANNELS];	//task to signal when the bus is free again
+	ULONG free_signal[SSPI_CHANNELS];		//signal mask for free_task
 };
 
-int spi_initialize(unsigned char channel);
-void spi_shutdown();
-void spi_set_speed(long speed);
-void spi_obtain();
-void spi_release();
-void spi_select();
-void spi_deselect();
+#if defined(SSPI_USE_LIBRARY)
+
+//calls go through sspi.library, SSPIBase must be opened by the program
+#include <proto/sspi.h>
+
+#elif !defined(SSPI_LIBRARY)
+
+//spi-lib linked into the program
+int spi_initialize(__reg("d0") unsigned char channel);
+void spi_shutdown(void);
+void spi_set_speed(__reg("d0") long speed);
+void spi_set_trailing_clocks(__reg("d0") UBYTE bytes);
+void spi_obtain(void);
+int spi_try_obtain(void);
+void spi_release(void);
+void spi_set_free_signal(__reg("a0") struct Task *task, __reg("d0") ULONG sigmask);
+void spi_select(void);
+void spi_deselect(void);
+void spi_deselect_lazy(void);
 void spi_read(__reg("a0") unsigned char *buf, __reg("d0") UWORD size);
 void spi_write(__reg("a0") const unsigned char *buf, __reg("d0") UWORD size);
+UWORD spi_read_blocks(__reg("a0") unsigned char *buf, __reg("d0") UWORD count, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token);
+UWORD spi_read_csum(__reg("a0") unsigned char *buf, __reg("d0") UWORD size);
+void spi_clock(__reg("d0") UWORD size);
+void spi_skip(__reg("d0") UWORD size);
+UBYTE spi_scan(__reg("d0") UWORD polls);
+void spi_command(__reg("a0") const unsigned char *tx, __reg("d0") UWORD txsize, __reg("a1") unsigned char *rx, __reg("d1") UWORD rxsize);
+void spi_read_2(__reg("a0") unsigned char *buf);
+void spi_read_6(__reg("a0") unsigned char *buf);
+void spi_read_14(__reg("a0") unsigned char *buf);
+void spi_read_512(__reg("a0") unsigned char *buf);
+void spi_write_2(__reg("a0") const unsigned char *buf);
+void spi_write_6(__reg("a0") const unsigned char *buf);
+void spi_write_512(__reg("a0") const unsigned char *buf);
+void spi_set_priority(__reg("d0") BYTE priority);
+void spi_set_max_hold(__reg("d0") ULONG us);
+int spi_yield(void);
+int spi_yield_due(void);
+const struct sspi_stats_TYPE *spi_get_stats(__reg("d0") unsigned char channel);
+const char *spi_get_kernel_name(void);
+
+#endif
 
 #endif
@@ -18,8 +18,93 @@
 
         XDEF        _spi_read_fast
         XDEF        _spi_write_fast
+        XDEF        _spi_read_blocks_fast
+        XDEF        _spi_read_slow
+        XDEF        _spi_write_slow
+        XDEF        _spi_delay
+        XDEF        _spi_read_fast_020
+        XDEF        _spi_write_fast_020
+        XDEF        _spi_clock_fast
+        XDEF        _spi_skip_fast
+        XDEF        _spi_scan_fast
+        XDEF        _spi_read_csum_fast
+        XDEF        _spi_read_2_fast
+        XDEF        _spi_read_6_fast
+        XDEF        _spi_read_14_fast
+        XDEF        _spi_read_512_fast
+        XDEF        _spi_write_2_fast
+        XDEF        _spi_write_6_fast
+        XDEF        _spi_write_512_fast
+        XDEF        _spi_read_512_fast_020
+        XDEF        _spi_write_512_fast_020
+        XDEF        _spi_read_blocks_fast_020
         CODE
 
+SD_BLOCK_WORDS:	equ	256							;512 byte data block
+SD_TOKEN_POLLS:	equ	8192							;~125ms worth of token polls on a 7MHz 68000
+
+UNROLL_WORDS:	equ	16								;words per loop in the 512 byte kernels
+
+					; reads one word into (a0)+, uses d2/d3
+
+SPI_READ_WORD	macro
+					move.b	(a1),d3						;get first byte in d3[15:8]
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d2						;get second byte in d2[7:0]
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2
+					move.b	d2,d3							;combine bytes into word
+					move.w	d3,(a0)+						;write word to buffer
+					endm
+
+					; writes one byte from (a0)+, uses d1
+
+SPI_WRITE_BYTE	macro
+					move.b	(a0)+,d1						;get byte from buffer
+					move.b	d1,(a1)						;shift out 8 bits
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					add.w		d1,d1
+					move.b	d1,(a1)
+					endm
+
 
 					; a0 = UBYTE *buf
 					; a1 = pointer to I/O port
@@ -157,4 +242,988 @@ _spi_read_fast:
 					
 .read_done:					
  					move.l  	(a7)+,d1
-               rts 
\ No newline at end of file
+               rts
+               
+               
+               
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; a2 = UWORD *crc, received CRC of each block (NULL = discard)
+					; a3 = UBYTE *token, error token that stopped the loop (NULL = discard)
+					; d0 = UWORD number of 512 byte data blocks
+					; returns d0 = number of blocks not read
+					;
+					; Streams SD data blocks: polls for the start token, reads the
+					; payload straight into the buffer, clocks in the CRC and then
+					; continues polling for the next token without leaving the loop.
+					; An odd buffer gets a leading and a trailing byte around 255 words.
+
+_spi_read_blocks_fast:
+					movem.l	d2-d4/a2,-(a7)				;push on stack
+					move.w	d0,d4							;d4 = blocks left
+					beq		.blocks_done
+
+.block_loop:
+					move.w	#SD_TOKEN_POLLS-1,d1		;poll counter for start token
+
+.token_loop:
+					move.b	(a1),d0						;shift in 8 bits
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					lsr.w		#7,d0							;byte is now in d0[7:0]
+
+					cmpi.b	#$fe,d0						;start token?
+					beq		.token_found
+					cmpi.b	#$ff,d0						;anything but idle is an error token
+					bne		.error_token
+					dbra		d1,.token_loop
+					bra		.blocks_done				;token is late, let the caller wait for it
+
+.token_found:
+					move.w	#SD_BLOCK_WORDS-1,d1		;word loop counter
+					move.w	a0,d0							;d0 = 1 if buffer address odd
+					andi.w	#1,d0
+					beq		.block_word_loop
+					bsr		.block_byte					;leading byte makes the buffer even
+					subq.w	#1,d1							;one word less, trailing byte follows
+
+.block_word_loop:
+					move.b	(a1),d3						;get first byte in d3[15:8]
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+
+					move.b	(a1),d2						;get second byte in d2[7:0]
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2
+
+					move.b	d2,d3							;combine bytes into word
+					move.w	d3,(a0)+						;write word to buffer
+
+					dbra		d1,.block_word_loop
+
+					tst.w		d0								;odd buffer: trailing byte
+					beq		.block_crc
+					bsr		.block_byte
+
+.block_crc:
+					move.l	a2,d0							;keep the CRC?
+					beq		.skip_crc
+
+					move.b	(a1),d3						;get CRC high byte in d3[15:8]
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+
+					move.b	(a1),d2						;get CRC low byte in d2[7:0]
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2
+
+					move.b	d2,d3							;combine bytes into word
+					move.w	d3,(a2)+						;write CRC to CRC buffer
+					bra		.next_block
+
+.skip_crc:
+					move.b	(a1),d0						;clock in and discard the 16 bit CRC
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+					move.b	(a1),d0
+
+.next_block:
+					subq.w	#1,d4							;next block
+					bne		.block_loop
+
+.blocks_done:
+					move.w	d4,d0							;return number of blocks left
+					movem.l	(a7)+,d2-d4/a2				;pop from stack
+					rts
+
+.error_token:
+					move.l	a3,d1							;the token is gone from the bus,
+					beq		.blocks_done				;hand it to the caller
+					move.b	d0,(a3)
+					move.w	d4,d0							;return number of blocks left
+					movem.l	(a7)+,d2-d4/a2				;pop from stack
+					rts
+
+.block_byte:
+					move.b	(a1),d2						;shift in 8 bits
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2							;byte is now in d2[7:0]
+					move.b	d2,(a0)+						;write byte to buffer
+					rts
+               
+               
+               
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; d0 = UWORD size
+					; d1 = UWORD delay loops after every bit
+					;
+					; Slow speed read, each bit is followed by d1+1 iterations of
+					; the same dbra loop as _spi_delay, so the bit time is the
+					; time of a bit without delay plus d1 loop iterations.
+
+_spi_read_slow:
+					movem.l	d2-d4,-(a7)					;push on stack
+					bra		.slow_read_start
+
+.slow_read_loop:
+					moveq		#7,d3							;8 bits
+.slow_read_bit:
+					move.b	(a1),d4						;shift in 1 bit
+					add.w		d4,d4
+					move.w	d1,d2							;wait
+.slow_read_wait:
+					dbra		d2,.slow_read_wait
+					dbra		d3,.slow_read_bit
+
+					lsr.w		#8,d4							;byte is now in d4[7:0]
+					move.b	d4,(a0)+						;write byte to buffer
+
+.slow_read_start:
+					dbra		d0,.slow_read_loop
+
+					movem.l	(a7)+,d2-d4					;pop from stack
+					rts
+               
+               
+               
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; d0 = UWORD size
+					; d1 = UWORD delay loops after every bit
+
+_spi_write_slow:
+					movem.l	d2-d4,-(a7)					;push on stack
+					bra		.slow_write_start
+
+.slow_write_loop:
+					move.b	(a0)+,d4						;get byte from buffer
+					moveq		#7,d3							;8 bits
+.slow_write_bit:
+					move.b	d4,(a1)						;shift out 1 bit
+					add.w		d4,d4
+					move.w	d1,d2							;wait
+.slow_write_wait:
+					dbra		d2,.slow_write_wait
+					dbra		d3,.slow_write_bit
+
+.slow_write_start:
+					dbra		d0,.slow_write_loop
+
+					movem.l	(a7)+,d2-d4					;pop from stack
+					rts
+               
+               
+               
+               
+               
+               
+               
+
+					; d0 = UWORD loops
+					;
+					; d0+1 iterations of the delay loop of the slow kernels,
+					; used to calibrate them
+
+_spi_delay:
+.delay_loop:
+					dbra		d0,.delay_loop
+					rts
+               
+               
+               
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; d0 = UWORD size
+					;
+					; 68020+ read: 32 bits are shifted into one register through
+					; the X flag and stored with a single move.l, the 68020 does
+					; not need an aligned buffer for that.
+
+_spi_read_fast_020:
+					movem.l	d1-d3,-(a7)					;push on stack
+					move.w	d0,d3							;long loop counter = size/4
+					lsr.w		#2,d3
+					bra		.read_long_start
+
+.read_long_loop:
+					move.b	(a1),d1						;bit into X
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.l	d2,d2
+					move.l	d2,(a0)+						;write long to buffer
+.read_long_start:
+					dbra		d3,.read_long_loop
+
+					andi.w	#3,d0							;remaining bytes
+					bra		.read_tail_start
+
+.read_tail_loop:
+					moveq		#7,d3							;8 bits
+.read_tail_bit:
+					move.b	(a1),d1
+					add.b		d1,d1
+					addx.b	d2,d2
+					dbra		d3,.read_tail_bit
+					move.b	d2,(a0)+						;write byte to buffer
+.read_tail_start:
+					dbra		d0,.read_tail_loop
+
+					movem.l	(a7)+,d1-d3					;pop from stack
+					rts
+               
+               
+               
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; d0 = UWORD size
+					;
+					; 68020+ write: 4 bytes are fetched with one move.l and rotated
+					; into the low byte one at a time.
+
+_spi_write_fast_020:
+					movem.l	d1-d2,-(a7)					;push on stack
+					move.w	d0,d1							;long loop counter = size/4
+					lsr.w		#2,d1
+					bra		.write_long_start
+
+.write_long_loop:
+					move.l	(a0)+,d2						;get 4 bytes from buffer
+					rol.l		#8,d2							;next byte into d2[7:0]
+					move.b	d2,(a1)						;shift out 8 bits
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					rol.l		#8,d2							;next byte into d2[7:0]
+					move.b	d2,(a1)						;shift out 8 bits
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					rol.l		#8,d2							;next byte into d2[7:0]
+					move.b	d2,(a1)						;shift out 8 bits
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					rol.l		#8,d2							;next byte into d2[7:0]
+					move.b	d2,(a1)						;shift out 8 bits
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+					move.b	d2,(a1)
+					add.b		d2,d2
+.write_long_start:
+					dbra		d1,.write_long_loop
+
+					andi.w	#3,d0							;remaining bytes
+					bra		.write_tail_start
+
+.write_tail_loop:
+					move.b	(a0)+,d2						;get byte from buffer
+					moveq		#7,d1							;8 bits
+.write_tail_bit:
+					move.b	d2,(a1)
+					add.b		d2,d2
+					dbra		d1,.write_tail_bit
+.write_tail_start:
+					dbra		d0,.write_tail_loop
+
+					movem.l	(a7)+,d1-d2					;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a1 = pointer to I/O port
+					; d0 = UWORD number of bytes
+					;
+					; Clocks out 0xff bytes, MOSI stays high so there is no source buffer.
+
+_spi_clock_fast:
+					move.l	d1,-(a7)						;push on stack
+					moveq		#-1,d1							;all bits set
+					bra		.clock_start
+
+.clock_loop:
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+					move.b	d1,(a1)
+
+.clock_start:
+					dbra		d0,.clock_loop
+
+					move.l	(a7)+,d1						;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a1 = pointer to I/O port
+					; d0 = UWORD number of bytes
+					;
+					; Clocks in bytes and discards them, nothing is written to memory.
+
+_spi_skip_fast:
+					bra		.skip_start
+
+.skip_loop:
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+					tst.b		(a1)
+
+.skip_start:
+					dbra		d0,.skip_loop
+					rts
+               
+               
+               
+               
+
+					; a1 = pointer to I/O port
+					; d0 = UWORD maximum number of bytes to poll
+					; returns d0 = first byte that is not 0xff, 0xff if there was none
+					;
+					; Polls for a token or response without a call per byte.
+
+_spi_scan_fast:
+					move.l	d1,-(a7)						;push on stack
+					move.w	d0,d1							;d1 = poll counter
+					bra		.scan_start
+
+.scan_loop:
+					move.b	(a1),d0						;shift in 8 bits
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					lsr.w		#7,d0							;byte is now in d0[7:0]
+
+					cmpi.b	#$ff,d0						;anything but idle ends the scan
+					bne		.scan_done
+
+.scan_start:
+					dbra		d1,.scan_loop
+					moveq		#-1,d0							;nothing but idle bytes
+
+.scan_done:
+					andi.w	#$ff,d0
+					move.l	(a7)+,d1						;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf (must be even)
+					; a1 = pointer to I/O port
+					; d0 = UWORD size
+					; returns d0 = 32 bit sum of the data as big endian words, not folded
+					;
+					; Reads like _spi_read_fast and adds up every word on the way for an
+					; internet checksum. An odd last byte counts as the high byte of a word.
+
+_spi_read_csum_fast:
+					movem.l	d1-d4,-(a7)				;push on stack
+					moveq		#0,d3							;d3[31:16] stays clear for the sum
+					moveq		#0,d4							;d4 = sum
+					move.w	d0,d1							;word loop counter = size/2
+					lsr.w		#1,d1
+					bra		.csum_word_start
+
+.csum_word_loop:
+					move.b	(a1),d3						;get first byte in d3[15:8]
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+					move.b	(a1),d3
+					add.w		d3,d3
+
+					move.b	(a1),d2						;get second byte in d2[7:0]
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2
+
+					move.b	d2,d3							;combine bytes into word
+					move.w	d3,(a0)+						;write word to buffer
+					add.l		d3,d4							;add it to the sum
+
+.csum_word_start:
+					dbra		d1,.csum_word_loop
+
+					btst		#0,d0							;odd size?
+					beq		.csum_done
+
+					moveq		#0,d2
+					move.b	(a1),d2						;shift in 8 bits
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					add.w		d2,d2
+					move.b	(a1),d2
+					lsr.w		#7,d2							;byte is now in d2[7:0]
+					move.b	d2,(a0)+						;write byte to buffer
+					andi.w	#$ff,d2						;add it to the sum as a high byte
+					lsl.w		#8,d2
+					add.l		d2,d4
+
+.csum_done:
+					move.l	d4,d0							;return sum
+					movem.l	(a7)+,d1-d4				;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf (must be even)
+					; a1 = pointer to I/O port
+
+_spi_read_2_fast:
+					movem.l	d2-d3,-(a7)				;push on stack
+					rept		1
+					SPI_READ_WORD
+					endr
+					movem.l	(a7)+,d2-d3				;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf (must be even)
+					; a1 = pointer to I/O port
+
+_spi_read_6_fast:
+					movem.l	d2-d3,-(a7)				;push on stack
+					rept		3
+					SPI_READ_WORD
+					endr
+					movem.l	(a7)+,d2-d3				;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf (must be even)
+					; a1 = pointer to I/O port
+
+_spi_read_14_fast:
+					movem.l	d2-d3,-(a7)				;push on stack
+					rept		7
+					SPI_READ_WORD
+					endr
+					movem.l	(a7)+,d2-d3				;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf (must be even)
+					; a1 = pointer to I/O port
+					;
+					; Unrolled UNROLL_WORDS at a time, a fully unrolled sector would not fit
+					; in a sensible amount of code.
+
+_spi_read_512_fast:
+					movem.l	d1-d3,-(a7)				;push on stack
+					moveq		#SD_BLOCK_WORDS/UNROLL_WORDS-1,d1
+
+.read_512_loop:
+					rept		UNROLL_WORDS
+					SPI_READ_WORD
+					endr
+					dbra		d1,.read_512_loop
+
+					movem.l	(a7)+,d1-d3				;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+
+_spi_write_2_fast:
+					move.l	d1,-(a7)						;push on stack
+					rept		2
+					SPI_WRITE_BYTE
+					endr
+					move.l	(a7)+,d1						;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+
+_spi_write_6_fast:
+					move.l	d1,-(a7)						;push on stack
+					rept		6
+					SPI_WRITE_BYTE
+					endr
+					move.l	(a7)+,d1						;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					;
+					; Unrolled 2*UNROLL_WORDS bytes at a time, like _spi_read_512_fast.
+
+_spi_write_512_fast:
+					move.l	d1,-(a7)						;push on stack
+					moveq		#SD_BLOCK_WORDS/UNROLL_WORDS-1,d0
+
+.write_512_loop:
+					rept		2*UNROLL_WORDS
+					SPI_WRITE_BYTE
+					endr
+					dbra		d0,.write_512_loop
+
+					move.l	(a7)+,d1						;pop from stack
+					rts
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					;
+					; The 68020 kernels already move 32 bits per loop, a sector is
+					; just a fixed size for them.
+
+_spi_read_512_fast_020:
+					move.w	#2*SD_BLOCK_WORDS,d0			;512 bytes
+					bra		_spi_read_fast_020
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+
+_spi_write_512_fast_020:
+					move.w	#2*SD_BLOCK_WORDS,d0			;512 bytes
+					bra		_spi_write_fast_020
+               
+               
+               
+               
+
+					; a0 = UBYTE *buf
+					; a1 = pointer to I/O port
+					; a2 = UWORD *crc, received CRC of each block (NULL = discard)
+					; a3 = UBYTE *token, error token that stopped the loop (NULL = discard)
+					; d0 = UWORD number of 512 byte data blocks
+					; returns d0 = number of blocks not read
+					;
+					; 68020+ version of _spi_read_blocks_fast. The payload is read 32 bits
+					; at a time: 24 bits are shifted up through d3 and the last byte is
+					; merged in from d2, so a bit costs the same two instructions as on
+					; the 68000 but the merge and store happen once per long instead of
+					; once per word. The 68020 stores longs at any address, so an odd
+					; buffer needs no leading and trailing byte.
+
+_spi_read_blocks_fast_020:
+					movem.l	d2-d4/a2,-(a7)				;push on stack
+					move.w	d0,d4							;d4 = blocks left
+					beq		.blocks_done
+
+.block_loop:
+					move.w	#SD_TOKEN_POLLS-1,d1		;poll counter for start token
+
+.token_loop:
+					move.b	(a1),d0						;shift in 8 bits
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					add.w		d0,d0
+					move.b	(a1),d0
+					lsr.w		#7,d0							;byte is now in d0[7:0]
+
+					cmpi.b	#$fe,d0						;start token?
+					beq		.token_found
+					cmpi.b	#$ff,d0						;anything but idle is an error token
+					bne		.error_token
+					dbra		d1,.token_loop
+					bra		.blocks_done				;token is late, let the caller wait for it
+
+.token_found:
+					moveq		#SD_BLOCK_WORDS/2-1,d1		;long loop counter
+
+.block_long_loop:
+					rept		24
+					move.b	(a1),d3						;get 3 bytes in d3[31:8]
+					add.l		d3,d3
+					endr
+					rept		7
+					move.b	(a1),d2						;get last byte in d2[7:0]
+					add.w		d2,d2
+					endr
+					move.b	(a1),d2
+					lsr.w		#7,d2
+					move.b	d2,d3							;combine bytes into long
+					move.l	d3,(a0)+						;write long to buffer
+					dbra		d1,.block_long_loop
+
+					move.l	a2,d0							;keep the CRC?
+					beq		.skip_crc
+
+					rept		8
+					move.b	(a1),d3						;get CRC high byte in d3[15:8]
+					add.w		d3,d3
+					endr
+					rept		7
+					move.b	(a1),d2						;get CRC low byte in d2[7:0]
+					add.w		d2,d2
+					endr
+					move.b	(a1),d2
+					lsr.w		#7,d2
+					move.b	d2,d3							;combine bytes into word
+					move.w	d3,(a2)+						;write CRC to CRC buffer
+					bra		.next_block
+
+.skip_crc:
+					rept		16
+					move.b	(a1),d0						;clock in and discard the 16 bit CRC
+					endr
+
+.next_block:
+					subq.w	#1,d4							;next block
+					bne		.block_loop
+
+.blocks_done:
+					move.w	d4,d0							;return number of blocks left
+					movem.l	(a7)+,d2-d4/a2				;pop from stack
+					rts
+
+.error_token:
+					move.l	a3,d1							;the token is gone from the bus,
+					beq		.blocks_done				;hand it to the caller
+					move.b	d0,(a3)
+					move.w	d4,d0							;return number of blocks left
+					movem.l	(a7)+,d2-d4/a2				;pop from stack
+					rts
@@ -0,0 +1,83 @@
+/*  SPI library for the Simple SPI controller
+ *
+ *  Per user state of spi-lib and the library base of sspi.library
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SSPI_BASE_H_INCLUDED
+#define SSPI_BASE_H_INCLUDED
+
+#include <exec/libraries.h>
+#include "spi.h"
+
+//state of one user (driver) of the bus
+struct spi_context_TYPE
+{
+	long channel;							//SPI channel (chip_select) to use, 0 = not initialized
+	struct sspi_channel_TYPE *chan;			//configuration of the channel, in the resource when it has room for it
+	struct sspi_channel_TYPE local_channel;	//configuration when the resource has no room for it
+	ULONG obtained_at;						//time the bus was obtained, for the maximum hold time
+	UBYTE bus_taken;						//number of nested spi_obtain/spi_try_obtain calls
+	UBYTE deselect_pending;					//chip select is still asserted after spi_deselect_lazy
+};
+
+//sspi.library base, every opener gets its own copy with its own context
+struct sspi_base_TYPE
+{
+	struct Library lib;
+	struct sspi_base_TYPE *master;			//the library in the system list, NULL in the master itself
+	BPTR seg_list;
+	struct spi_context_TYPE context;
+};
+
+#ifdef SSPI_LIBRARY
+
+//library entry points, the library base is passed in a6
+int spi_initialize(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") unsigned char channel);
+void spi_shutdown(__reg("a6") struct sspi_base_TYPE *base);
+void spi_set_speed(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") long speed);
+void spi_set_trailing_clocks(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") UBYTE bytes);
+void spi_obtain(__reg("a6") struct sspi_base_TYPE *base);
+int spi_try_obtain(__reg("a6") struct sspi_base_TYPE *base);
+void spi_release(__reg("a6") struct sspi_base_TYPE *base);
+void spi_set_free_signal(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") struct Task *task, __reg("d0") ULONG sigmask);
+void spi_select(__reg("a6") struct sspi_base_TYPE *base);
+void spi_deselect(__reg("a6") struct sspi_base_TYPE *base);
+void spi_deselect_lazy(__reg("a6") struct sspi_base_TYPE *base);
+void spi_read(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf, __reg("d0") UWORD size);
+void spi_write(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") const unsigned char *buf, __reg("d0") UWORD size);
+UWORD spi_read_blocks(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf, __reg("d0") UWORD count, __reg("a2") UWORD *crc, __reg("a3") UBYTE *token);
+UWORD spi_read_csum(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf, __reg("d0") UWORD size);
+void spi_clock(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") UWORD size);
+void spi_skip(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") UWORD size);
+UBYTE spi_scan(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") UWORD polls);
+void spi_command(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") const unsigned char *tx, __reg("d0") UWORD txsize, __reg("a1") unsigned char *rx, __reg("d1") UWORD rxsize);
+void spi_read_2(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf);
+void spi_read_6(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf);
+void spi_read_14(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf);
+void spi_read_512(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") unsigned char *buf);
+void spi_write_2(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") const unsigned char *buf);
+void spi_write_6(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") const unsigned char *buf);
+void spi_write_512(__reg("a6") struct sspi_base_TYPE *base, __reg("a0") const unsigned char *buf);
+void spi_set_priority(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") BYTE priority);
+void spi_set_max_hold(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") ULONG us);
+int spi_yield(__reg("a6") struct sspi_base_TYPE *base);
+int spi_yield_due(__reg("a6") struct sspi_base_TYPE *base);
+const struct sspi_stats_TYPE *spi_get_stats(__reg("a6") struct sspi_base_TYPE *base, __reg("d0") unsigned char channel);
+const char *spi_get_kernel_name(__reg("a6") struct sspi_base_TYPE *base);
+
+#endif
+
+#endif
@@ -40,9 +40,15 @@
 #include "spi.h"
 #include "timer.h"
 #include "sana2.h"
+#include "sspinet.h"
 #include "common.h"
 #include "vb_interrupt.h"
 
+#ifndef S2_PacketFilter
+/* Not in the oldest sana2.h */
+#define S2_PacketFilter           (S2_Dummy + 3)
+#endif
+
 /* START of name/id/version/revision
  * remember to also change VERSION constant in romtag.asm
  */ 
@@ -56,6 +62,12 @@
 #define ETHERSPI_TASK_NAME        "sspinet"
 #define ETHERSPI_TASK_PRIO        12
 #define ETHERSPI_STACK_SIZE       2048
+/* Bus priority above the SD card (0), so long SD transfers end their
+   command early and received frames are read before the NIC buffer fills */
+#define ETHERSPI_BUS_PRIO         10
+/* Frames read per packet count check, the receive buffer holds about four
+   full size frames and more small ones */
+#define ETHERSPI_RX_BATCH         8
 
 
 typedef BOOL (*etherspi_bmfunc_t)(__reg("a0") APTR dst, __reg("a1") APTR src, __reg("d0") LONG size);
@@ -65,6 +77,7 @@ typedef struct
     struct MinNode        node;
     etherspi_bmfunc_t    copyfrom;
     etherspi_bmfunc_t    copyto;
+    struct Hook          *filter;
 } etherspi_buffer_funcs_t;
 
 //make sure all members are aligned at longword boundaries
@@ -89,6 +102,7 @@ typedef struct
     struct SignalSemaphore				write_list_sem;
 
     etherspi_buffer_funcs_t				*bf;
+    struct IOSana2Req					*rx_req;		/* read request chosen by device_wants for the frame */
     unsigned char						frame[NIC_MTU + sizeof(nic_eth_hdr_t)];
 } etherspi_ctx_t;
 #pragma pack(pop)
@@ -100,6 +114,9 @@ static etherspi_ctx_t *ctx;
 struct ExecBase *SysBase;
 struct DosLibrary *DOSBase;
 struct Library *UtilityBase; 
+#ifdef SSPI_USE_LIBRARY
+struct Library *SSPIBase;
+#endif
 
 /* Some text strings */
 char device_name[] = DEVICE_NAME;
@@ -143,6 +160,132 @@ static void device_query(struct IOSana2Req *req)
     query->SizeSupplied = MIN(query->SizeAvailable, 30);
 }
 
+/* Called by nic_recv_batch with the start of every received frame. Takes
+   the first read request of the frame's packet type whose packet filter
+   accepts it, a frame nobody takes is dropped before the rest is read. The
+   type is matched on the header alone, a prefix of the data is only asked
+   for when a packet filter has to look at it. The filter only sees the
+   first <peeked> bytes of the frame. */
+static int device_wants(void *user, const uint8_t *frame, unsigned int length, unsigned int peeked)
+{
+    const nic_eth_hdr_t *hdr = (const nic_eth_hdr_t*)frame;
+    struct IOSana2Req *ios2;
+    etherspi_buffer_funcs_t *bf;
+    int more = 0;
+
+    ctx->rx_req = NULL;
+
+    ObtainSemaphore(&ctx->read_list_sem);
+    for (ios2 = (struct IOSana2Req*)ctx->read_list.lh_Head; ios2->ios2_Req.io_Message.mn_Node.ln_Succ; ios2 = (struct IOSana2Req*)ios2->ios2_Req.io_Message.mn_Node.ln_Succ) 
+    {
+        if (ios2->ios2_PacketType != hdr->type) 
+        {
+            continue;
+        }
+
+        bf = (etherspi_buffer_funcs_t*)ios2->ios2_BufferManagement;
+        if (bf->filter && peeked == sizeof(nic_eth_hdr_t) && length > peeked) 
+        {
+            more = 1;
+            break;
+        }
+        if (bf->filter) 
+        {
+            memcpy(ios2->ios2_SrcAddr, hdr->src, NIC_MACADDR_SIZE);
+            memcpy(ios2->ios2_DstAddr, hdr->dest, NIC_MACADDR_SIZE);
+            if (ios2->ios2_Req.io_Flags & SANA2IOF_RAW) 
+            {
+                ios2->ios2_DataLength = length;
+                if (!CallHookPkt(bf->filter, ios2, (APTR)frame)) 
+                {
+                    continue;
+                }
+            } 
+            else 
+            {
+                ios2->ios2_DataLength = length - sizeof(nic_eth_hdr_t);
+                if (!CallHookPkt(bf->filter, ios2, (APTR)&hdr[1])) 
+                {
+                    continue;
+                }
+            }
+        }
+
+        Remove((struct Node*)ios2);
+        ctx->rx_req = ios2;
+        break;
+    }
+    ReleaseSemaphore(&ctx->read_list_sem);
+
+    if (more) 
+    {
+        return NIC_RX_MORE;
+    }
+
+    return ctx->rx_req != NULL;
+}
+
+/* Called by nic_recv_batch for every received frame, hands it to the read
+   request taken by device_wants */
+static void device_receive(void *user, uint8_t *frame, unsigned int length, unsigned int rxflags)
+{
+    struct IOSana2Req *ios2;
+    struct IORequest *ioreq;
+    nic_eth_hdr_t *hdr = (nic_eth_hdr_t*)frame;
+    etherspi_buffer_funcs_t *bf;
+
+    ios2 = ctx->rx_req;
+    ctx->rx_req = NULL;
+    ioreq = (struct IORequest*)ios2;
+
+    if (ios2) 
+    {
+        int n;
+
+        /* Copy packet to io request buffer */
+        bf = (etherspi_buffer_funcs_t*)ios2->ios2_BufferManagement;
+        if (ioreq->io_Flags & SANA2IOF_RAW) 
+        {
+            /* Verbatim */
+            ios2->ios2_DataLength = length;
+            bf->copyto(ios2->ios2_Data, frame, ios2->ios2_DataLength);
+            ioreq->io_Flags = SANA2IOF_RAW;
+        } 
+        else 
+        {
+            /* Skip header */
+            ios2->ios2_DataLength = length - sizeof(nic_eth_hdr_t);
+            bf->copyto(ios2->ios2_Data, &hdr[1], ios2->ios2_DataLength);
+            ioreq->io_Flags = 0;
+        }
+
+        /* Extract ethernet header data */
+        memcpy(ios2->ios2_SrcAddr, hdr->src, NIC_MACADDR_SIZE);
+        memcpy(ios2->ios2_DstAddr, hdr->dest, NIC_MACADDR_SIZE);
+        ioreq->io_Flags |= SANA2IOF_BCAST;
+        for (n = 0; n < NIC_MACADDR_SIZE; n++) 
+        {
+            if (hdr->dest[n] != 0xff) 
+            {
+                ioreq->io_Flags &= ~SANA2IOF_BCAST;
+                break;
+            }
+        }
+        if (rxflags & NIC_RXF_CSUM_OK)
+        {
+            ioreq->io_Flags |= SSPINETIOF_CSUM_OK;
+        }
+        ios2->ios2_PacketType = hdr->type;
+        ioreq->io_Error = 0;
+
+        ReplyMsg(&ioreq->io_Message);
+    } 
+    else 
+    {
+        /* FIXME: No matching read request - place packet in orphan queue */
+    }
+}
+
 void __saveds device_task(void)
 {
     UBYTE nic_keep_alive_interval = 0;
@@ -153,7 +296,7 @@ void __saveds device_task(void)
         struct IORequest *ioreq;
         nic_eth_hdr_t *hdr = (nic_eth_hdr_t*)ctx->frame;
         etherspi_buffer_funcs_t *bf;
-        int len;
+        int count;
         ULONG sigs;
         
         /* Wait for signals from driver and vertical blank interrupt server */
@@ -188,10 +331,9 @@ void __saveds device_task(void)
                         bf->copyfrom(&hdr[1], ios2->ios2_Data, ios2->ios2_DataLength);
                     }
 
-                    /* Write */
-                    Forbid();
+                    /* Write, the NIC layer holds the SPI bus for it so other
+                       tasks keep running */
                     nic_send(ctx->frame, ios2->ios2_DataLength + ((ioreq->io_Flags & SANA2IOF_RAW) ? 0 : sizeof(nic_eth_hdr_t)));
-                    Permit();
 
                     /* Reply to message */
                     ioreq->io_Error = 0;
@@ -213,73 +355,14 @@ void __saveds device_task(void)
         //check periodically for new packets
         if (sigs & ctx->rx_signal_mask) 
 		{
-			/* Signal from periodic vertical blank interrupt, poll for RX data */
+			/* Signal from periodic vertical blank interrupt (or the SPI bus
+			   became free after a busy poll), poll for RX data. A busy bus
+			   ends the poll without waiting for it. */
             do 
             {
-                Forbid();
-                len = nic_recv(ctx->frame, NIC_MTU);
-                Permit();
-
-                if (len >= 0) 
-                {
-                    /* Packet received - search read list for read request of correct type */
-                    ObtainSemaphore(&ctx->read_list_sem);
-                    for (ios2 = (struct IOSana2Req*)ctx->read_list.lh_Head; ios2; ios2 = (struct IOSana2Req*)ios2->ios2_Req.io_Message.mn_Node.ln_Succ) 
-                    {
-                        if (ios2->ios2_PacketType == hdr->type) 
-                        {
-                            Remove((struct Node*)ios2);
-                            break;
-                        }
-                    }
-                    ReleaseSemaphore(&ctx->read_list_sem);
-                    ioreq = (struct IORequest*)ios2;
-
-                    if (ios2) 
-                    {
-                        int n;
-
-                        /* Copy packet to io request buffer */
-                        bf = (etherspi_buffer_funcs_t*)ios2->ios2_BufferManagement;
-                        if (ioreq->io_Flags & SANA2IOF_RAW) 
-                        {
-                            /* Verbatim */
-                            ios2->ios2_DataLength = len;
-                            bf->copyto(ios2->ios2_Data, ctx->frame, ios2->ios2_DataLength);
-                            ioreq->io_Flags = SANA2IOF_RAW;
-                        } 
-                        else 
-                        {
-                            /* Skip header */
-                            ios2->ios2_DataLength = len - sizeof(nic_eth_hdr_t);
-                            bf->copyto(ios2->ios2_Data, &hdr[1], ios2->ios2_DataLength);
-                            ioreq->io_Flags = 0;
-                        }
-
-                        /* Extract ethernet header data */
-                        memcpy(ios2->ios2_SrcAddr, hdr->src, NIC_MACADDR_SIZE);
-                        memcpy(ios2->ios2_DstAddr, hdr->dest, NIC_MACADDR_SIZE);
-                        ioreq->io_Flags |= SANA2IOF_BCAST;
-                        for (n = 0; n < NIC_MACADDR_SIZE; n++) 
-                        {
-                            if (hdr->dest[n] != 0xff) 
-                            {
-                                ioreq->io_Flags &= ~SANA2IOF_BCAST;
-                                break;
-                            }
-                        }
-                        ios2->ios2_PacketType = hdr->type;
-                        ioreq->io_Error = 0;
-
-                        ReplyMsg(&ioreq->io_Message);
-                    } 
-                    else 
-                    {
-                        /* FIXME: No matching read request - place packet in orphan queue */
-                    }
-                }
+                count = nic_recv_batch(ctx->frame, NIC_MTU, ETHERSPI_RX_BATCH, device_wants, device_receive, NULL);
             } 
-            while (len >= 0);
+            while (count > 0);
         }
     }
 }
@@ -311,6 +394,15 @@ static struct Device *init_device(__reg("a6") struct ExecBase *sys_base, __reg("
         goto error;
     }
 
+#ifdef SSPI_USE_LIBRARY
+    SSPIBase = OpenLibrary(SSPI_LIBRARY_NAME, SSPI_LIBRARY_VERSION);
+    if (SSPIBase == NULL) 
+    {
+        ERROR("sspi.library not found\n");
+        goto error;
+    }
+#endif
+
     /* Allocate driver context */
     ctx = AllocMem(sizeof(etherspi_ctx_t), MEMF_PUBLIC | MEMF_CLEAR);
     if (ctx == NULL) 
@@ -345,13 +437,18 @@ static struct Device *init_device(__reg("a6") struct ExecBase *sys_base, __reg("
     InitSemaphore(&ctx->write_list_sem);
 
     /* Initialise hardware, select port 2, fast speed */
+    timer_init();
     spi_initialize(SPI_CHANNEL_2);
     spi_set_speed(SPI_SPEED_FAST);
+    spi_set_priority(ETHERSPI_BUS_PRIO);
     nic_init();
 
     /* Start receiver task */
 	ctx->handler_task = CreateTask((char *)ETHERSPI_TASK_NAME, ETHERSPI_TASK_PRIO, (char *)device_task, ETHERSPI_STACK_SIZE);
 
+	/* A poll that found the bus busy is retried as soon as it is free */
+	spi_set_free_signal(ctx->handler_task, ctx->rx_signal_mask);
+
 	/* Register VB interrupt server */
 	ctx->interrupt = Start_Vb_Interrupt(ctx->handler_task, ctx->rx_signal);	 
 	if(ctx->interrupt == NULL)
@@ -365,6 +462,12 @@ static struct Device *init_device(__reg("a6") struct ExecBase *sys_base, __reg("
 
 error:
     /* Clean up after failed open */
+#ifdef SSPI_USE_LIBRARY
+    if (SSPIBase) 
+    {
+        CloseLibrary(SSPIBase);
+    }
+#endif
     if (UtilityBase) 
     {
         CloseLibrary((struct Library*)UtilityBase);
@@ -399,8 +502,15 @@ static BPTR expunge(__reg("a6") struct Library *dev)
     
     /* stop spi */
     spi_shutdown();
+    timer_shutdown();
 
     /* Clean up libs */
+#ifdef SSPI_USE_LIBRARY
+    if (SSPIBase) 
+    {
+        CloseLibrary(SSPIBase);
+    }
+#endif
     if (UtilityBase) 
     {
         CloseLibrary((struct Library*)UtilityBase);
@@ -430,6 +540,7 @@ static void open(__reg("a6") struct Library *dev, __reg("a1") struct IORequest *
         {
             bf->copyfrom = (etherspi_bmfunc_t)GetTagData(S2_CopyFromBuff, 0UL, (struct TagItem*)ios2->ios2_BufferManagement);
             bf->copyto = (etherspi_bmfunc_t)GetTagData(S2_CopyToBuff, 0UL, (struct TagItem*)ios2->ios2_BufferManagement);
+            bf->filter = (struct Hook*)GetTagData(S2_PacketFilter, 0UL, (struct TagItem*)ios2->ios2_BufferManagement);
             ctx->bf = bf;
 			dev->lib_OpenCnt++;
 
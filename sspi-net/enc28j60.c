@@ -46,6 +46,13 @@
 
 #include "common.h" //for INFO, TRACE and SWAP macro's
 
+/// Time to wait after a soft reset (errata: CLKRDY is not reliable, wait 1 ms)
+#define ENC28J60_RESET_US		1000
+/// MII operations take 10.24 us
+#define ENC28J60_MII_TIMEOUT_US	1000
+
+// The NIC state below is only used with the SPI bus held, the bus semaphore
+// keeps it consistent with the chip
 
 static uint8_t enc28j60_current_bank = 0;		/*!< Currently selected bank */
 static uint8_t enc28j60_link_status = 0;			/*!< Current link status */
@@ -84,7 +91,7 @@ static int enc28j60_set_bank(uint8_t addr)
 		buf[1] = ECON1_BSEL1 | ECON1_BSEL0;
 
 		spi_select();
-		spi_write(buf, 2);
+		spi_write_2(buf);
 		spi_deselect();
 				
 		// Set up the new bank
@@ -92,7 +99,7 @@ static int enc28j60_set_bank(uint8_t addr)
 		buf[1] = bank;
 
 		spi_select();
-		spi_write(buf, 2);
+		spi_write_2(buf);
 		spi_deselect();
 		
 		// Update stored bank number
@@ -122,7 +129,7 @@ static int enc28j60_set_bits(uint8_t addr, uint8_t val)
 	buf[1] = val;
 
 	spi_select();
-	spi_write(buf, 2);
+	spi_write_2(buf);
 	spi_deselect();
 	return 0;
 }
@@ -147,7 +154,7 @@ static int enc28j60_clear_bits(uint8_t addr, uint8_t val)
 	buf[1] = val;
 
 	spi_select();
-	spi_write(buf, 2);
+	spi_write_2(buf);
 	spi_deselect();
 	return 0;
 }
@@ -168,7 +175,7 @@ static int enc28j60_write_reg(uint8_t addr, uint8_t val)
 	buf[1] = val;
 
 	spi_select();
-	spi_write(buf, 2);
+	spi_write_2(buf);
 	spi_deselect();
 
 	return 0;
@@ -189,10 +196,7 @@ static int enc28j60_read_reg(uint8_t addr)
 	txbuf[0] = (addr & 0x1f) | ENC28J60_SPI_RCR;
 
 	// Transfer 2 bytes for ETH registers, 3 for MAC and MII
-	spi_select();
-	spi_write(txbuf, 1);
-	spi_read(rxbuf, (addr & ENC28J60_MACREG) ? 2 : 1);
-	spi_deselect();
+	spi_command(txbuf, 1, rxbuf, (addr & ENC28J60_MACREG) ? 2 : 1);
 
 	return (int)rxbuf[((addr & ENC28J60_MACREG) ? 1 : 0)];
 }
@@ -218,6 +222,26 @@ static int enc28j60_read_reg16(uint8_t addr)
 	return (l | (h << 8));
 }
 
+/// \brief Wait for the MII to finish the current operation
+/// \return -1 on timeout, otherwise 0.
+static int enc28j60_wait_mii(void)
+{
+	uint32_t start = timer_get_us();
+	int expired;
+
+	for (;;) {
+		// Read once more after the timeout before giving up
+		expired = timer_get_us() - start >= ENC28J60_MII_TIMEOUT_US;
+		if (!(enc28j60_read_reg(MISTAT) & MISTAT_BUSY)) {
+			return 0;
+		}
+		if (expired) {
+			ERROR("MII busy timeout\n");
+			return -1;
+		}
+	}
+}
+
 /// \brief Write to a PHY register
 /// The ENC28J60 PHY module's registers can only be accessed indirectly through
 /// the MAC.  This function provides write functionality.
@@ -228,9 +252,7 @@ static int enc28j60_write_phy(uint8_t addr, uint16_t val)
 {
 	int status = 0;
 
-	/// \todo Check for busy
-	/// \bug Timeout?
-	while (enc28j60_read_reg(MISTAT) & MISTAT_BUSY) {}
+	status |= enc28j60_wait_mii();
 
 	status |= enc28j60_write_reg(MIREGADR, addr & 0x1f);
 	status |= enc28j60_write_reg16(MIWRL, val);
@@ -246,18 +268,14 @@ static int enc28j60_read_phy(uint8_t addr)
 {
 	int status = 0;
 
-	/// \todo Check for busy
-	/// \bug Timeout?
-	while (enc28j60_read_reg(MISTAT) & MISTAT_BUSY) {}
+	status |= enc28j60_wait_mii();
 
 	// Set up the transfer.  Can't do bitfield ops on MAC or MII
 	// registers so just do a write to set the MIIRD bit.
 	status |= enc28j60_write_reg(MIREGADR, addr & 0x1f);
 	status |= enc28j60_write_reg(MICMD, MICMD_MIIRD);
 
-	/// \todo Poll busy bit??? Wait 10.24 us
-	/// Doing it this way probably takes ages
-	while (enc28j60_read_reg(MISTAT) & MISTAT_BUSY) {}
+	status |= enc28j60_wait_mii();
 
 	// Stop reading
 	status |= enc28j60_write_reg(MICMD, 0);
@@ -290,13 +308,96 @@ static int enc28j60_write_buf(const uint8_t *buf, unsigned int length)
 /// \return -1 on error, otherwise 0.
 static int enc28j60_read_buf(uint8_t *buf, unsigned int length)
 {
-	spi_select();
-	spi_write((const uint8_t[]){ ENC28J60_SPI_RBM }, 1);
-	spi_read(buf, length);
-	spi_deselect();
+	spi_command((const uint8_t[]){ ENC28J60_SPI_RBM }, 1, buf, length);
 	return 0;
 }
 
+/// \brief Add up bytes as big endian words
+/// \param p Pointer to the data, the first byte is the high byte of a word.
+/// \param length Number of bytes.
+/// \param sum Sum to add to.
+/// \return New sum, not folded.
+static uint32_t enc28j60_sum(const uint8_t *p, unsigned int length, uint32_t sum)
+{
+	for (; length > 1; length -= 2, p += 2) {
+		sum += ((uint16_t)p[0] << 8) | p[1];
+	}
+	if (length) {
+		sum += (uint16_t)p[0] << 8;
+	}
+	return sum;
+}
+
+static uint16_t enc28j60_fold(uint32_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)sum;
+}
+
+/// \brief Verify the TCP or UDP checksum of a received IPv4 frame
+/// \param frame Pointer to the received frame.
+/// \param length Length of the frame, without the ethernet CRC.
+/// \param sum Ones complement sum of the frame after the ethernet header.
+/// \return 1 if the checksum is present and correct, otherwise 0.
+static int enc28j60_l4_csum_ok(const uint8_t *frame, unsigned int length, uint16_t sum)
+{
+	const uint8_t *ip = frame + sizeof(nic_eth_hdr_t);
+	unsigned int ihl, total, pad;
+	uint32_t s, pad_sum;
+
+	if (length < sizeof(nic_eth_hdr_t) + ENC28J60_IP_HDR_MIN ||
+			frame[12] != (ENC28J60_ETHERTYPE_IPV4 >> 8) || frame[13] != (ENC28J60_ETHERTYPE_IPV4 & 0xff) ||
+			(ip[0] >> 4) != 4) {
+		return 0;
+	}
+
+	ihl = (ip[0] & 0xf) * 4;
+	total = ((unsigned int)ip[2] << 8) | ip[3];
+	if (ihl < ENC28J60_IP_HDR_MIN || total < ihl + ENC28J60_UDP_HDR_SIZE || sizeof(nic_eth_hdr_t) + total > length) {
+		return 0;
+	}
+
+	// Fragments are checked by the stack once the datagram is complete
+	if ((ip[6] & 0x3f) || ip[7]) {
+		return 0;
+	}
+
+	if (ip[9] == ENC28J60_IP_PROTO_UDP) {
+		// A zero UDP checksum means the sender did not compute one
+		if (ip[ihl + 6] == 0 && ip[ihl + 7] == 0) {
+			return 0;
+		}
+	} else if (ip[9] != ENC28J60_IP_PROTO_TCP) {
+		return 0;
+	}
+
+	// A valid IP header sums to 0xffff, which leaves the sum unchanged, so
+	// only the header itself needs a separate check
+	if (enc28j60_fold(enc28j60_sum(ip, ihl, 0)) != 0xffff) {
+		return 0;
+	}
+
+	// Take out the ethernet padding of short frames
+	s = sum;
+	pad = length - sizeof(nic_eth_hdr_t) - total;
+	if (pad) {
+		if (total & 1) {
+			pad_sum = enc28j60_sum(ip + total + 1, pad - 1, ip[total]);
+		} else {
+			pad_sum = enc28j60_sum(ip + total, pad, 0);
+		}
+		s += 0xffff - enc28j60_fold(pad_sum);
+	}
+
+	// Add the pseudo header: addresses, protocol and segment length
+	s = enc28j60_sum(ip + 12, 8, s);
+	s += ip[9] + (total - ihl);
+
+	return enc28j60_fold(s) == 0xffff;
+}
+
 #if (ENC28J60_DUMP_REGS==1)
 static void enc28j60_dump_regs(void)
 {
@@ -348,6 +449,130 @@ static uint16_t enc28j60_rxrdpt_fix(uint16_t next_packet_ptr)
 	return rxrdpt;
 }
 
+/// \brief Step an address in the receive buffer forward, wrapping like AUTOINC
+static uint16_t enc28j60_rx_advance(uint16_t addr, unsigned int count)
+{
+	addr += count;
+	if (addr > RXSTOP_INIT) {
+		addr -= RXSTOP_INIT + 1 - RXSTART_INIT;
+	}
+	return addr;
+}
+
+/// \brief Transfer the next frame from the receive buffer in one RBM burst
+/// Reads the receive status and the frame, then clocks past the CRC and
+/// padding so ERDPT ends up at the next frame without being written.
+/// ERDPT must point at enc28j60_next_packet and the bus must be held.
+/// \param buf Pointer to the buffer in which to place the frame.
+/// \param length Size of the buffer, longer frames are truncated.
+/// \param flags Returns NIC_RXF_ flags of the frame.
+/// \param resync Set to 1 if ERDPT is not at the next frame afterwards.
+/// \param want Called with the ethernet header and up to NIC_RX_PEEK bytes
+/// of the frame before the rest is read, NULL to take every frame.
+/// \param user Passed on to want.
+/// \return Number of bytes read, -1 for a bad or unwanted frame.
+static int enc28j60_rx_frame(uint8_t *buf, unsigned int length, unsigned int *flags, int *resync, nic_rx_want_t want, void *user)
+{
+	enc28j60_rx_status_t rxstatus;
+	unsigned int stored, done, tail, peek;
+	uint16_t sum;
+	int take;
+	int result = -1;
+	int discard = 0;
+
+	*flags = 0;
+
+	spi_select();
+	spi_write((const uint8_t[]){ ENC28J60_SPI_RBM }, 1);
+	spi_read_6((uint8_t*)&rxstatus);
+
+	// 68k is big endian!
+	rxstatus.next_packet = SWAP16(rxstatus.next_packet);
+	rxstatus.length = SWAP16(rxstatus.length);
+	rxstatus.status = SWAP16(rxstatus.status);
+
+	// Bytes of the frame in the buffer, with the 4 byte CRC
+	stored = rxstatus.length;
+	done = 0;
+
+	if ((rxstatus.status & ENC28J60_RXSTATUS_OK) && stored > 4) {
+		// Truncate if the buffer is too small
+		if (stored - 4 < length) {
+			length = stored - 4;
+		}
+		if (length > sizeof(nic_eth_hdr_t)) {
+			// Sum the payload on the way in, the checksum then costs no extra
+			// pass. want decides on the header, a prefix is only read when it
+			// asks for one. The sums of both parts add up as NIC_RX_PEEK is even.
+			spi_read_14(buf);
+			sum = 0;
+			peek = sizeof(nic_eth_hdr_t);
+			take = want ? want(user, buf, length, peek) : 1;
+			if (take == NIC_RX_MORE) {
+				peek = (length < NIC_RX_PEEK) ? length : NIC_RX_PEEK;
+				sum = spi_read_csum(buf + sizeof(nic_eth_hdr_t), peek - sizeof(nic_eth_hdr_t));
+				take = want(user, buf, length, peek);
+			}
+			if (!take) {
+				// Nobody wants it, leave the rest in the NIC
+				discard = 1;
+				done = peek;
+			} else {
+				if (length > peek) {
+					sum = enc28j60_fold((uint32_t)sum + spi_read_csum(buf + peek, length - peek));
+				}
+				if (enc28j60_l4_csum_ok(buf, length, sum)) {
+					*flags |= NIC_RXF_CSUM_OK;
+				}
+				done = length;
+				result = length;
+			}
+		} else {
+			spi_read(buf, length);
+			done = length;
+			result = length;
+		}
+	} else {
+		// Packet is bad
+		// FIXME: Error counters
+	}
+
+	// Clock past the rest of the frame and the padding to an even address.
+	// A next packet pointer that does not follow the frame is taken as it
+	// is, ERDPT is then written before the next frame. That is also cheaper
+	// than clocking past the payload of a discarded frame.
+	tail = enc28j60_rx_advance(enc28j60_next_packet, sizeof(rxstatus) + done);
+	tail = (rxstatus.next_packet >= tail) ? rxstatus.next_packet - tail :
+		rxstatus.next_packet + (RXSTOP_INIT + 1 - RXSTART_INIT) - tail;
+	if (!discard && stored <= NIC_MTU + 4 && tail <= stored - done + 1) {
+		if (tail) {
+			spi_skip(tail);
+		}
+		*resync = 0;
+	} else {
+		*resync = 1;
+	}
+	spi_deselect();
+
+	enc28j60_next_packet = rxstatus.next_packet;
+
+#if ENC28J60_DEBUG_PACKETS
+	{
+		int n;
+		fprintf(stderr, "RX %u bytes (status = %02X) %s\n", done, rxstatus.status, (result < 0) ? "ERROR" : "OK");
+		for (n = 0; n < done; n++) {
+			fprintf(stderr, "%02X ", buf[n]);
+			if ((n & 15) == 15) {
+				fprintf(stderr, "\n");
+			}
+		}
+		fprintf(stderr, "\n");
+	}
+#endif
+
+	return result;
+}
+
 /// Detect and initialise the Ethernet hardware.
 int nic_init(void)
 {
@@ -357,10 +582,8 @@ int nic_init(void)
 	spi_obtain();
 
 	// Perform a software reset
-	spi_select();
-	spi_write((const uint8_t[]){ ENC28J60_SPI_SRC }, 1);
-	spi_deselect();
-	timer_delay(TIMER_MILLIS(10));
+	spi_command((const uint8_t[]){ ENC28J60_SPI_SRC }, 1, NULL, 0);
+	timer_sleep_us(ENC28J60_RESET_US);
 
 	/* Default status */
 	enc28j60_current_bank = 0;
@@ -439,11 +662,14 @@ int nic_init(void)
 	return 0;
 }
 
-/// Returns number of packets available for reading
+/// Returns number of packets available for reading, NIC_BUSY if the SPI bus
+/// is in use by another device
 int nic_poll(void)
 {
-	//obtain SPI bus
-	spi_obtain();	
+	//obtain SPI bus, but do not wait for it
+	if (!spi_try_obtain()) {
+		return NIC_BUSY;
+	}
 	
 	// Poll for a packet
 	int packet_count = enc28j60_read_reg(EPKTCNT);
@@ -454,78 +680,110 @@ int nic_poll(void)
 	return packet_count;
 }
 
-/// Receives next packet, if one is available
-/// \param buf Pointer to a buffer in which to place the received data.
+/// Receives up to <max> packets, reading the packet count only once
+/// Every frame is read in one SPI burst and freed in the NIC right after it,
+/// then the bus is released while func handles the frame. The next frame is
+/// only read if the bus can be obtained again without waiting, otherwise it
+/// stays in the NIC for the next call.
+/// \param buf Pointer to a buffer in which to place each frame.
 /// \param length Size of the buffer, in bytes.
-/// \return Number of bytes actually read.  -1 on error (no packet available).
-int nic_recv(uint8_t *buf, unsigned int length)
+/// \param max Maximum number of packets to receive.
+/// \param want Called with the header of every good frame (see
+/// nic_rx_want_t), with the SPI bus held. Returns 0 to drop the frame without
+/// reading the rest of it from the NIC, or NIC_RX_MORE to be called again
+/// with a longer prefix. NULL to take every frame.
+/// \param func Called for every good frame with the length and NIC_RXF_
+/// flags, without the SPI bus.
+/// \param user Passed on to want and func.
+/// \return Number of packets taken from the NIC, bad ones included. -1 on
+/// error, NIC_BUSY if the SPI bus is in use by another device.
+int nic_recv_batch(uint8_t *buf, unsigned int length, unsigned int max, nic_rx_want_t want, nic_rx_func_t func, void *user)
 {
 	int status = 0;
-	enc28j60_rx_status_t rxstatus;
+	int count, n, len, resync;
+	unsigned int flags;
 
-	//obtain SPI bus
-	spi_obtain();	
-	
-	if (enc28j60_read_reg(EPKTCNT) <= 0) 
-	{
+	//obtain SPI bus, but do not wait for it
+	if (!spi_try_obtain()) {
+		return NIC_BUSY;
+	}
+
+	count = enc28j60_read_reg(EPKTCNT);
+	if (count > (int)max) {
+		count = max;
+	}
+	if (count <= 0) {
 		//release SPI bus
 		spi_release();
 
-		// No packet 
-		return -1;
+		// No packet
+		return 0;
 	}
 
-	// Set the read pointer to where the packet should be
-	status |= enc28j60_write_reg16(ERDPTL, enc28j60_next_packet);
+	// Set the read pointer to where the first packet should be, AUTOINC
+	// walks the ring from there
+	resync = 1;
+	for (n = 0; n < count; n++) {
+		if (resync) {
+			status |= enc28j60_write_reg16(ERDPTL, enc28j60_next_packet);
+		}
+		len = enc28j60_rx_frame(buf, length, &flags, &resync, want, user);
 
-	// Read the header so we can determine the packet length
-	status |= enc28j60_read_buf((uint8_t*)&rxstatus, sizeof(rxstatus));
+		// Update the receive pointer to free the memory taken by the packet
+		// and decrement EPKTCNT to acknowledge it
+		status |= enc28j60_write_reg16(ERXRDPTL, enc28j60_rxrdpt_fix(enc28j60_next_packet));
+		status |= enc28j60_set_bits(ECON2, ECON2_PKTDEC);
 
-	// 68k is big endian!
-	rxstatus.next_packet = SWAP16(rxstatus.next_packet);
-	rxstatus.length = SWAP16(rxstatus.length) - 4; /* Also remove 4 byte CRC */
-	rxstatus.status = SWAP16(rxstatus.status);
+		//release SPI bus, the frame is handed over without it. ERDPT
+		//stays where the frame ended, nothing else reads the NIC.
+		spi_release();
 
-	if (rxstatus.status & ENC28J60_RXSTATUS_OK) {
-		// Transfer the received packet into the buffer, truncating if the
-		// buffer is too small
-		if (rxstatus.length < length) {
-			length = rxstatus.length;
+		if (len >= 0) {
+			func(user, buf, len, flags);
+		}
+
+		//obtain SPI bus for the next frame, but do not wait for it
+		if (n + 1 < count && !spi_try_obtain()) {
+			return (status < 0) ? -1 : n + 1;
 		}
-		status |= enc28j60_read_buf(buf, length);
-	} else {
-		// Packet is bad
-		// FIXME: Error counters
-		status = -1;
 	}
 
-	// Update next packet pointer
-	enc28j60_next_packet = rxstatus.next_packet;
+	return (status < 0) ? -1 : count;
+}
 
-	// Update the receive pointer to free the memory taken by this packet
-	status |= enc28j60_write_reg16(ERXRDPTL, enc28j60_rxrdpt_fix(enc28j60_next_packet));
+typedef struct {
+	int length;
+	unsigned int flags;
+} enc28j60_recv_result_t;
 
-	// Decrement EPKTCNT to acknowledge the packet
-	status |= enc28j60_set_bits(ECON2, ECON2_PKTDEC);
+static void enc28j60_recv_one(void *user, uint8_t *frame, unsigned int length, unsigned int flags)
+{
+	enc28j60_recv_result_t *result = user;
 
-#if ENC28J60_DEBUG_PACKETS
-	{
-		int n;
-		fprintf(stderr, "RX %u bytes (status = %02X) %s\n", length, rxstatus.status, (status < 0) ? "ERROR" : "OK");
-		for (n = 0; n < length; n++) {
-			fprintf(stderr, "%02X ", buf[n]);
-			if ((n & 15) == 15) {
-				fprintf(stderr, "\n");
-			}
-		}
-		fprintf(stderr, "\n");
-	}
-#endif
+	result->length = length;
+	result->flags = flags;
+}
 
-	//release SPI bus
-	spi_release();
+/// Receives next packet, if one is available
+/// \param buf Pointer to a buffer in which to place the received data.
+/// \param length Size of the buffer, in bytes.
+/// \param flags Returns NIC_RXF_ flags of the packet, NULL if not needed.
+/// \return Number of bytes actually read.  -1 on error (no packet available),
+/// NIC_BUSY if the SPI bus is in use by another device.
+int nic_recv(uint8_t *buf, unsigned int length, unsigned int *flags)
+{
+	enc28j60_recv_result_t result = { -1, 0 };
+	int count;
 
-	return (status < 0) ? -1 : length;
+	count = nic_recv_batch(buf, length, 1, NULL, enc28j60_recv_one, &result);
+	if (count == NIC_BUSY) {
+		return NIC_BUSY;
+	}
+
+	if (flags) {
+		*flags = result.flags;
+	}
+	return result.length;
 }
 
 /// Writes a packet to the transmit buffer and starts transmission.
@@ -625,21 +883,21 @@ void nic_get_mac_address(uint8_t *buf)
 
 int nic_keep_alive (void)
 {   
-   //obtain SPI bus
+	int hang;
+
+	//obtain SPI bus, for the check and the reinitialisation, so nothing
+	//else sees the NIC in between
 	spi_obtain();	
 	
-   int econ1 = enc28j60_read_reg(ECON1);
-	
-	//release SPI bus
-	spi_release();
-	
-	if( !(econ1&ECON1_RXEN) )
+	hang = !(enc28j60_read_reg(ECON1) & ECON1_RXEN);
+	if (hang)
 	{
-	
 		TRACE("enc28j60 hang detected\n");
-		nic_init();	
-		return 1;
+		nic_init();
 	}
-	else
-		return 0;
+
+	//release SPI bus
+	spi_release();
+	
+	return hang;
 }
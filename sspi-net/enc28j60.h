@@ -350,6 +350,13 @@
 #define ENC28J60_TX_PCRCEN		(1 << 1)
 #define ENC28J60_TX_POVERRIDE	(1 << 0)
 
+/*! Protocol fields used to verify received checksums */
+#define ENC28J60_ETHERTYPE_IPV4	0x0800
+#define ENC28J60_IP_PROTO_TCP	6
+#define ENC28J60_IP_PROTO_UDP	17
+#define ENC28J60_IP_HDR_MIN		20
+#define ENC28J60_UDP_HDR_SIZE	8
+
 /*! Receive packet status header */
 #pragma pack(push,1)
 typedef struct {
@@ -46,6 +46,10 @@
 /*! Returns the minimum of two values */
 #define MIN(a,b)            ((a) < (b) ? (a) : (b))
 
+#ifdef SSPI_USE_LIBRARY
+struct Library *SSPIBase;
+#endif
+
 
 
 
@@ -78,7 +82,17 @@ int main(void)
 
 	printf("ENC28J60 NIC test\n");
 
+#ifdef SSPI_USE_LIBRARY
+	SSPIBase = OpenLibrary(SSPI_LIBRARY_NAME, SSPI_LIBRARY_VERSION);
+	if(SSPIBase == NULL)
+	{
+		printf("sspi.library not found\n");
+		return 20;
+	}
+#endif
+
 	/* Initialise hardware */
+	timer_init();
 	if(spi_initialize(SPI_CHANNEL_2)>0)
 		printf("SPI initialized\n");
 	else
@@ -119,9 +133,7 @@ int main(void)
 			
 			do 
 			{
-				Forbid();
-				len = nic_recv(rxbuf, sizeof(rxbuf));
-				Permit();
+				len = nic_recv(rxbuf, sizeof(rxbuf), NULL);
 				if (len >= 0) 
 				{
 					printf("RX %d bytes:\n", len);
@@ -143,7 +155,10 @@ int main(void)
 
 	printf("Cleaning up\n");
 	Stop_Vb_Interrupt(interrupt);
-
+	timer_shutdown();
+#ifdef SSPI_USE_LIBRARY
+	CloseLibrary(SSPIBase);
+#endif
 
 	return 0;
 }
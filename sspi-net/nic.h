@@ -28,6 +28,12 @@
 #define NIC_MTU					1518
 #define NIC_BPS					10000000ul
 
+/* nic_poll/nic_recv: the SPI bus is in use, try again later */
+#define NIC_BUSY				-2
+
+/* Flags returned by nic_recv */
+#define NIC_RXF_CSUM_OK			0x01	/* TCP/UDP checksum of an IPv4 frame verified */
+
 #pragma pack(push,1)
 typedef struct {
 	uint8_t		dest[NIC_MACADDR_SIZE];
@@ -36,9 +42,33 @@ typedef struct {
 } nic_eth_hdr_t;
 #pragma pack(pop)
 
+/* The nic_ functions obtain the SPI bus themselves and only touch the NIC
+   and its state while they hold it, so no Forbid() is needed around them.
+   The bus nests per driver, not per task: do not call them from two tasks
+   at the same time. */
 int nic_init(void);
 int nic_poll(void);
-int nic_recv(uint8_t *buf, unsigned int length);
+int nic_recv(uint8_t *buf, unsigned int length, unsigned int *flags);
+
+/* Bytes at the start of a frame, header included, read for a want callback
+   that asks for more than the header. Even, for the receive checksum. */
+#define NIC_RX_PEEK				64
+
+/* Return value of a want callback that needs more than the header */
+#define NIC_RX_MORE				2
+
+/* Called by nic_recv_batch for every good frame, with the SPI bus held. The
+   first <peeked> of <length> bytes of <frame> have been read, the header
+   only at first. Returns 0 to drop the frame without reading the rest, or
+   NIC_RX_MORE on the header to be called again after up to NIC_RX_PEEK
+   bytes were read. */
+typedef int (*nic_rx_want_t)(void *user, const uint8_t *frame, unsigned int length, unsigned int peeked);
+
+/* Called by nic_recv_batch for every good frame, after the frame was freed
+   in the NIC and the SPI bus was released */
+typedef void (*nic_rx_func_t)(void *user, uint8_t *frame, unsigned int length, unsigned int flags);
+
+int nic_recv_batch(uint8_t *buf, unsigned int length, unsigned int max, nic_rx_want_t want, nic_rx_func_t func, void *user);
 int nic_send(const uint8_t *buf, unsigned int length);
 
 void nic_get_mac_address(uint8_t *buf);
@@ -0,0 +1,31 @@
+/*
+ *  SPI NET ENC28J60 device driver for Amiga 500
+ *
+ *  Definitions for programs using sspinet.device
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SSPINET_H_
+#define SSPINET_H_
+
+/* Device specific io_Flags of a completed CMD_READ / S2_READORPHAN.
+ * Bits 4 and up of io_Flags are for the device, SANA-II uses 5-7.
+ */
+
+/* The frame is IPv4 TCP or UDP and its checksum was verified by the driver */
+#define SSPINETIOB_CSUM_OK		4
+#define SSPINETIOF_CSUM_OK		(1<<SSPINETIOB_CSUM_OK)
+
+#endif /* SSPINET_H_ */
@@ -25,6 +25,7 @@
 #include <proto/exec.h>
 #include <clib/alib_protos.h>
 #include <exec/types.h>
+#include <exec/alerts.h>
 #include <exec/devices.h>
 #include <exec/errors.h>
 #include <exec/execbase.h>
@@ -34,11 +35,16 @@
 #include <libraries/dos.h>
 #include <devices/timer.h>
 #include <devices/trackdisk.h>
+#include <devices/scsidisk.h>
 //#include <proto/exec.h>
+#include <string.h>
 
 
+#include "common.h"
 #include "sd.h"
 #include "spi.h"
+#include "mount.h"
+#include "timer.h"
 
 /* START of name/id/version/revision
  * remember to also change VERSION constant in romtag.asm
@@ -55,13 +61,26 @@
 
 #define DEBOUNCE_TIMEOUT_US 	100000
 
-#define SIGB_CARD_CHANGE 		30
+// Longest a transfer keeps the bus from a waiting channel of any priority.
+#define BUS_MAX_HOLD_US 		20000
+
+// Card presence is probed with this interval after a change or I/O,
+// doubling up to the maximum while nothing happens.
+#define PROBE_MIN_US 			250000
+#define PROBE_MAX_US 			2000000
+
+// Consecutive failed probes before an opened card is taken as removed.
+#define PROBE_FAILURES 			3
+
+#define SIGB_PROBE 				30
 #define SIGB_OP_REQUEST 		29
 #define SIGB_TIMER 				28
+#define SIGB_QUIT 				27
 
-#define SIGF_CARD_CHANGE 		(1 << SIGB_CARD_CHANGE)
+#define SIGF_PROBE 				(1 << SIGB_PROBE)
 #define SIGF_OP_REQUEST 		(1 << SIGB_OP_REQUEST)
 #define SIGF_OP_TIMER 			(1 << SIGB_TIMER)
+#define SIGF_QUIT 				(1 << SIGB_QUIT)
 
 #ifndef TD_GETGEOMETRY
 // Needed to compile with AmigaOS 1.3 headers.
@@ -82,12 +101,49 @@ struct DriveGeometry
 };
 #endif
 
+#ifndef TD_READ64
+// TD64 commands, the high 32 bits of the offset are passed in io_Actual.
+#define TD_READ64     24
+#define TD_WRITE64    25
+#define TD_SEEK64     26
+#define TD_FORMAT64   27
+#endif
+
+#ifndef NSCMD_DEVICEQUERY
+// New style device (NSD) commands, see devices/newstyle.h.
+#define NSCMD_DEVICEQUERY     0x4000
+#define NSCMD_TD_READ64       0xc000
+#define NSCMD_TD_WRITE64      0xc001
+#define NSCMD_TD_SEEK64       0xc002
+#define NSCMD_TD_FORMAT64     0xc003
+
+#define NSDEVTYPE_TRACKDISK   5
+
+struct NSDeviceQueryResult
+{
+    ULONG    DevQueryFormat;
+    ULONG    SizeAvailable;
+    UWORD    DeviceType;
+    UWORD    DeviceSubType;
+    UWORD    *SupportedCommands;
+};
+#endif
+
 struct ExecBase *SysBase;
+#ifdef SSPI_USE_LIBRARY
+struct Library *SSPIBase;
+#endif
 static BPTR saved_seg_list;
 static struct timerequest tr;
+static struct timerequest probe_tr;
+static ULONG probe_interval = PROBE_MIN_US;
+static ULONG probe_failures;
 static struct Task *task;
+static struct Task *boot_task;
+static struct Task *expunge_task;
 static struct MsgPort mp;
 static struct MsgPort timer_mp;
+static struct MsgPort probe_mp;
 static volatile BOOL card_present;
 static volatile BOOL card_opened;
 static volatile ULONG card_change_num;
@@ -98,12 +154,71 @@ static struct IOStdReq *change_int;
 char device_name[] = DEVICE_NAME;
 char id_string[] = DEVICE_ID_STRING;
 
+static UWORD supported_commands[] =
+{
+    CMD_RESET, CMD_READ, CMD_WRITE, CMD_UPDATE, CMD_CLEAR,
+    TD_MOTOR, TD_FORMAT, TD_REMOVE, TD_CHANGENUM, TD_CHANGESTATE,
+    TD_PROTSTATUS, TD_GETDRIVETYPE, TD_ADDCHANGEINT, TD_REMCHANGEINT,
+    TD_GETGEOMETRY, HD_SCSICMD,
+    TD_READ64, TD_WRITE64, TD_SEEK64, TD_FORMAT64,
+    NSCMD_DEVICEQUERY,
+    NSCMD_TD_READ64, NSCMD_TD_WRITE64, NSCMD_TD_SEEK64, NSCMD_TD_FORMAT64,
+    0
+};
+
+static BOOL is_64bit_command(UWORD command)
+{
+    switch (command)
+    {
+    case TD_READ64:
+    case TD_WRITE64:
+    case TD_SEEK64:
+    case TD_FORMAT64:
+    case NSCMD_TD_READ64:
+    case NSCMD_TD_WRITE64:
+    case NSCMD_TD_SEEK64:
+    case NSCMD_TD_FORMAT64:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void device_query(struct IOStdReq *ior)
+{
+    struct NSDeviceQueryResult *query = (struct NSDeviceQueryResult *)ior->io_Data;
+
+    if (!query || ior->io_Length < sizeof(struct NSDeviceQueryResult))
+    {
+        ior->io_Error = IOERR_BADLENGTH;
+        return;
+    }
+
+    query->DevQueryFormat = 0;
+    query->SizeAvailable = sizeof(struct NSDeviceQueryResult);
+    query->DeviceType = NSDEVTYPE_TRACKDISK;
+    query->DeviceSubType = 0;
+    query->SupportedCommands = supported_commands;
+    ior->io_Actual = sizeof(struct NSDeviceQueryResult);
+}
+
+// CID and CSD are read from the card on first use, NULL if there is no
+// card or that failed
+static const sd_card_info_t *device_card_info(void)
+{
+    const sd_card_info_t *ci = sd_get_card_info();
+
+    if (ci->type == sdCardType_None || sd_read_info() < 0)
+        return NULL;
+
+    return ci;
+}
+
 static uint32_t device_get_geometry(struct IOStdReq *ior)
 {
     struct DriveGeometry *geom = (struct DriveGeometry*)ior->io_Data;
-    const sd_card_info_t *ci = sd_get_card_info();
+    const sd_card_info_t *ci = device_card_info();
 
-    if (ci->type == sdCardType_None)
+    if (!ci)
         return TDERR_DiskChanged;
 
     geom->dg_SectorSize = 1 << ci->block_size;
@@ -118,23 +233,417 @@ static uint32_t device_get_geometry(struct IOStdReq *ior)
     return 0;
 }
 
-static void handle_changed()
+#define SCSI_TEST_UNIT_READY        0x00
+#define SCSI_REQUEST_SENSE          0x03
+#define SCSI_READ_6                 0x08
+#define SCSI_WRITE_6                0x0a
+#define SCSI_INQUIRY                0x12
+#define SCSI_MODE_SENSE_6           0x1a
+#define SCSI_START_STOP_UNIT        0x1b
+#define SCSI_READ_CAPACITY_10       0x25
+#define SCSI_READ_10                0x28
+#define SCSI_WRITE_10               0x2a
+#define SCSI_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_MODE_SENSE_10          0x5a
+#define SCSI_READ_16                0x88
+#define SCSI_WRITE_16               0x8a
+#define SCSI_SYNCHRONIZE_CACHE_16   0x91
+#define SCSI_SERVICE_ACTION_IN_16   0x9e
+#define SCSI_SA_READ_CAPACITY_16    0x10
+
+#define SCSI_STATUS_GOOD            0x00
+#define SCSI_STATUS_CHECK_CONDITION 0x02
+
+#define SENSE_NO_SENSE              0x00
+#define SENSE_NOT_READY             0x02
+#define SENSE_MEDIUM_ERROR          0x03
+#define SENSE_ILLEGAL_REQUEST       0x05
+
+#define ASC_NONE                    0x00
+#define ASC_NOT_READY               0x04
+#define ASC_WRITE_ERROR             0x0c
+#define ASC_READ_ERROR              0x11
+#define ASC_INVALID_OPCODE          0x20
+#define ASC_LBA_OUT_OF_RANGE        0x21
+#define ASC_INVALID_FIELD           0x24
+#define ASC_MEDIUM_NOT_PRESENT      0x3a
+
+#define SENSE_DATA_SIZE             18
+
+static UBYTE sense_key;
+static UBYTE sense_asc;
+
+static void put_be16(UBYTE *p, ULONG val)
+{
+    p[0] = (UBYTE)(val >> 8);
+    p[1] = (UBYTE)val;
+}
+
+static void put_be32(UBYTE *p, ULONG val)
+{
+    p[0] = (UBYTE)(val >> 24);
+    p[1] = (UBYTE)(val >> 16);
+    p[2] = (UBYTE)(val >> 8);
+    p[3] = (UBYTE)val;
+}
+
+static ULONG get_be16(const UBYTE *p)
+{
+    return ((ULONG)p[0] << 8) | p[1];
+}
+
+static ULONG get_be32(const UBYTE *p)
+{
+    return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+static void scsi_build_sense(UBYTE *sense)
+{
+    memset(sense, 0, SENSE_DATA_SIZE);
+    sense[0] = 0x70; // current error, fixed format
+    sense[2] = sense_key;
+    sense[7] = SENSE_DATA_SIZE - 8;
+    sense[12] = sense_asc;
+}
+
+// Copy command result data to the caller's buffer.
+static void scsi_reply_data(struct SCSICmd *scsi, const UBYTE *data, ULONG length)
+{
+    if (length > scsi->scsi_Length)
+        length = scsi->scsi_Length;
+
+    memcpy(scsi->scsi_Data, data, length);
+    scsi->scsi_Actual = length;
+}
+
+static UBYTE scsi_mode_sense(struct SCSICmd *scsi, const UBYTE *cmd)
+{
+    const sd_card_info_t *ci = sd_get_card_info();
+    UBYTE data[8 + 8 + 24 + 24];
+    BOOL ten = cmd[0] == SCSI_MODE_SENSE_10;
+    UBYTE page = cmd[2] & 0x3f;
+    ULONG length = ten ? 8 : 4;
+    ULONG cylinders = ci->total_sectors;
+
+    if (page != 0x03 && page != 0x04 && page != 0x3f)
+        return ASC_INVALID_FIELD;
+
+    memset(data, 0, sizeof(data));
+
+    // Block descriptor, unless disabled (DBD)
+    if (!(cmd[1] & 0x08))
+    {
+        put_be32(&data[length], MIN(ci->total_sectors, 0xffffff));
+        put_be32(&data[length + 4], SD_SECTOR_SIZE);
+        data[ten ? 7 : 3] = 8;
+        length += 8;
+    }
+
+    // Format device page, same 1 head / 1 sector geometry as TD_GETGEOMETRY
+    if (page == 0x03 || page == 0x3f)
+    {
+        data[length] = 0x03;
+        data[length + 1] = 0x16;
+        put_be16(&data[length + 10], 1);
+        put_be16(&data[length + 12], SD_SECTOR_SIZE);
+        length += 24;
+    }
+
+    // Rigid disk geometry page, cylinders is a 24 bit field
+    if (page == 0x04 || page == 0x3f)
+    {
+        data[length] = 0x04;
+        data[length + 1] = 0x16;
+        if (cylinders > 0xffffff)
+            cylinders = 0xffffff;
+        data[length + 2] = (UBYTE)(cylinders >> 16);
+        put_be16(&data[length + 3], cylinders);
+        data[length + 5] = 1;
+        length += 24;
+    }
+
+    if (ten)
+        put_be16(&data[0], length - 2);
+    else
+        data[0] = (UBYTE)(length - 1);
+
+    // Clip to the allocation length of the CDB
+    scsi_reply_data(scsi, data, MIN(ten ? get_be16(&cmd[7]) : cmd[4], length));
+    return ASC_NONE;
+}
+
+static UBYTE scsi_read_capacity(struct SCSICmd *scsi, const UBYTE *cmd)
+{
+    const sd_card_info_t *ci = sd_get_card_info();
+    UBYTE data[32];
+
+    memset(data, 0, sizeof(data));
+
+    if (cmd[0] == SCSI_READ_CAPACITY_10)
+    {
+        put_be32(&data[0], ci->total_sectors - 1);
+        put_be32(&data[4], SD_SECTOR_SIZE);
+        scsi_reply_data(scsi, data, 8);
+    }
+    else
+    {
+        // READ CAPACITY (16), upper 32 bits of the last LBA are always 0
+        put_be32(&data[4], ci->total_sectors - 1);
+        put_be32(&data[8], SD_SECTOR_SIZE);
+        scsi_reply_data(scsi, data, MIN(get_be32(&cmd[10]), sizeof(data)));
+    }
+
+    return ASC_NONE;
+}
+
+// READ and WRITE (6), (10) and (16). The whole transfer is passed to
+// sd_read/sd_write in one go so it uses the multi-block commands.
+static UBYTE scsi_read_write(struct SCSICmd *scsi, const UBYTE *cmd, BOOL write)
+{
+    const sd_card_info_t *ci = sd_get_card_info();
+    ULONG lba, count;
+    int err;
+
+    switch (cmd[0])
+    {
+    case SCSI_READ_6:
+    case SCSI_WRITE_6:
+        lba = ((ULONG)(cmd[1] & 0x1f) << 16) | ((ULONG)cmd[2] << 8) | cmd[3];
+        count = cmd[4] ? cmd[4] : 256;
+        break;
+
+    case SCSI_READ_10:
+    case SCSI_WRITE_10:
+        lba = get_be32(&cmd[2]);
+        count = ((ULONG)cmd[7] << 8) | cmd[8];
+        break;
+
+    default:
+        if (get_be32(&cmd[2]))
+            return ASC_LBA_OUT_OF_RANGE;
+        lba = get_be32(&cmd[6]);
+        count = get_be32(&cmd[10]);
+        break;
+    }
+
+    if (lba >= ci->total_sectors || count > ci->total_sectors - lba)
+        return ASC_LBA_OUT_OF_RANGE;
+
+    if (count > (scsi->scsi_Length >> SD_SECTOR_SHIFT))
+        return ASC_INVALID_FIELD;
+
+    if (count == 0)
+        return ASC_NONE;
+
+    if (write)
+        err = sd_write((uint8_t *)scsi->scsi_Data, lba, count);
+    else
+        err = sd_read((uint8_t *)scsi->scsi_Data, lba, count);
+
+    if (err != 0)
+    {
+        sense_key = SENSE_MEDIUM_ERROR;
+        return write ? ASC_WRITE_ERROR : ASC_READ_ERROR;
+    }
+
+    scsi->scsi_Actual = count << SD_SECTOR_SHIFT;
+    return ASC_NONE;
+}
+
+static UBYTE scsi_inquiry(struct SCSICmd *scsi, const UBYTE *cmd)
+{
+    UBYTE data[36];
+
+    // Vital product data pages are not supported
+    if (cmd[1] & 0x01)
+        return ASC_INVALID_FIELD;
+
+    memset(data, ' ', sizeof(data));
+    data[0] = 0x00; // direct access device
+    data[1] = 0x80; // removable medium
+    data[2] = 0x02; // SCSI-2
+    data[3] = 0x02; // response data format
+    data[4] = sizeof(data) - 5;
+    data[5] = 0;
+    data[6] = 0;
+    data[7] = 0;
+    memcpy(&data[8], "SSPI", 4);
+    memcpy(&data[16], "SD card", 7);
+    data[32] = '0' + DEVICE_VERSION;
+    data[33] = '.';
+    data[34] = '0' + DEVICE_REVISION;
+
+    scsi_reply_data(scsi, data, MIN(cmd[4], sizeof(data)));
+    return ASC_NONE;
+}
+
+// Translate a HD_SCSICMD request to the SD card.
+// CDB length of the group of <opcode>, 0 for the groups without a fixed
+// length. Those opcodes are not supported.
+static UWORD scsi_cdb_length(UBYTE opcode)
+{
+    switch (opcode >> 5)
+    {
+    case 0:
+        return 6;
+    case 1:
+    case 2:
+        return 10;
+    case 4:
+        return 16;
+    case 5:
+        return 12;
+    default:
+        return 0;
+    }
+}
+
+static void scsi_command(struct IOStdReq *ior)
+{
+    struct SCSICmd *scsi = (struct SCSICmd *)ior->io_Data;
+    const UBYTE *cmd;
+    UBYTE sense[SENSE_DATA_SIZE];
+    UBYTE asc = ASC_NONE;
+    BOOL short_cdb;
+
+    if (!scsi || ior->io_Length < sizeof(struct SCSICmd) || !scsi->scsi_Command || scsi->scsi_CmdLength == 0)
+    {
+        ior->io_Error = IOERR_BADLENGTH;
+        return;
+    }
+
+    cmd = scsi->scsi_Command;
+    short_cdb = scsi->scsi_CmdLength < scsi_cdb_length(cmd[0]);
+
+    scsi->scsi_Actual = 0;
+    scsi->scsi_CmdActual = scsi->scsi_CmdLength;
+    scsi->scsi_SenseActual = 0;
+
+    if (cmd[0] == SCSI_REQUEST_SENSE && !short_cdb)
+    {
+        scsi_build_sense(sense);
+        scsi_reply_data(scsi, sense, MIN(cmd[4], SENSE_DATA_SIZE));
+        sense_key = SENSE_NO_SENSE;
+        sense_asc = ASC_NONE;
+        scsi->scsi_Status = SCSI_STATUS_GOOD;
+        ior->io_Actual = sizeof(struct SCSICmd);
+        return;
+    }
+
+    // Illegal request unless a command changes it
+    sense_key = SENSE_ILLEGAL_REQUEST;
+
+    // The command is not decoded past the end of the CDB
+    if (short_cdb)
+        asc = ASC_INVALID_FIELD;
+    else if (cmd[0] == SCSI_INQUIRY)
+        asc = scsi_inquiry(scsi, cmd);
+    else if (!card_present || !card_opened)
+    {
+        sense_key = SENSE_NOT_READY;
+        asc = ASC_MEDIUM_NOT_PRESENT;
+    }
+    else if (!device_card_info())
+    {
+        // CID/CSD could not be read, the size of the card is unknown
+        sense_key = SENSE_NOT_READY;
+        asc = ASC_NOT_READY;
+    }
+    else
+    {
+        switch (cmd[0])
+        {
+        case SCSI_TEST_UNIT_READY:
+        case SCSI_START_STOP_UNIT:
+        case SCSI_SYNCHRONIZE_CACHE_10:
+        case SCSI_SYNCHRONIZE_CACHE_16:
+            break;
+
+        case SCSI_READ_6:
+        case SCSI_READ_10:
+        case SCSI_READ_16:
+            asc = scsi_read_write(scsi, cmd, FALSE);
+            break;
+
+        case SCSI_WRITE_6:
+        case SCSI_WRITE_10:
+        case SCSI_WRITE_16:
+            asc = scsi_read_write(scsi, cmd, TRUE);
+            break;
+
+        case SCSI_READ_CAPACITY_10:
+            asc = scsi_read_capacity(scsi, cmd);
+            break;
+
+        case SCSI_SERVICE_ACTION_IN_16:
+            if ((cmd[1] & 0x1f) == SCSI_SA_READ_CAPACITY_16)
+                asc = scsi_read_capacity(scsi, cmd);
+            else
+                asc = ASC_INVALID_FIELD;
+            break;
+
+        case SCSI_MODE_SENSE_6:
+        case SCSI_MODE_SENSE_10:
+            asc = scsi_mode_sense(scsi, cmd);
+            break;
+
+        default:
+            asc = ASC_INVALID_OPCODE;
+            break;
+        }
+    }
+
+    ior->io_Actual = sizeof(struct SCSICmd);
+
+    if (asc == ASC_NONE)
+    {
+        sense_key = SENSE_NO_SENSE;
+        sense_asc = ASC_NONE;
+        scsi->scsi_Status = SCSI_STATUS_GOOD;
+        return;
+    }
+
+    sense_asc = asc;
+    scsi->scsi_Status = SCSI_STATUS_CHECK_CONDITION;
+    ior->io_Error = HFERR_BadStatus;
+
+    if ((scsi->scsi_Flags & SCSIF_AUTOSENSE) && scsi->scsi_SenseData)
+    {
+        scsi_build_sense(sense);
+        scsi->scsi_SenseActual = MIN(scsi->scsi_SenseLength, SENSE_DATA_SIZE);
+        memcpy(scsi->scsi_SenseData, sense, scsi->scsi_SenseActual);
+    }
+}
+
+static void task_delay(ULONG micros)
 {
-    // Wait to debounce the card detect switch.
     tr.tr_node.io_Command = TR_ADDREQUEST;
-    tr.tr_time.tv_secs = 0;
-    tr.tr_time.tv_micro = DEBOUNCE_TIMEOUT_US;
+    tr.tr_time.tv_secs = micros / 1000000;
+    tr.tr_time.tv_micro = micros % 1000000;
     DoIO((struct IORequest *)&tr);
+}
+
+// Bring up the card, the task sleeps on the timer while the card is busy
+// and the bus is free for other users in the meantime.
+static int open_card()
+{
+    uint32_t wait_ms;
+    int err;
 
-    int res = 1;
+    sd_open_start();
+    while ((err = sd_open_step(&wait_ms)) == sdError_Busy)
+    {
+        if (wait_ms)
+            task_delay(wait_ms * 1000);
+    }
 
-    if (res == 1 && sd_open() == 0)
-        card_opened = TRUE;
-    else
-        card_opened = FALSE;
+    return err;
+}
 
+// Count the change and tell the clients about it
+static void notify_change()
+{
     Forbid();
-    card_present = res == 1;
     card_change_num++;
     Permit();
 
@@ -145,9 +654,46 @@ static void handle_changed()
         Cause((struct Interrupt *)change_int->io_Data);
 }
 
+static void handle_changed(BOOL present)
+{
+    if (present)
+    {
+        // Let the contacts settle before bringing the card up.
+        task_delay(DEBOUNCE_TIMEOUT_US);
+    }
+
+    if (present && open_card() == 0)
+        card_opened = TRUE;
+    else
+    {
+        sd_close();
+        card_opened = FALSE;
+    }
+
+    Forbid();
+    card_present = present;
+    notify_change();
+    Permit();
+}
+
 static void process_request(struct IOStdReq *ior)
 {
-    if (!card_present)
+    // 64 bit commands pass the high 32 bits of the byte offset in io_Actual.
+    ULONG offset_high = 0;
+    if (is_64bit_command(ior->io_Command))
+    {
+        offset_high = ior->io_Actual;
+        ior->io_Actual = 0;
+    }
+
+    // Sectors are 32 bits, so the offset is limited to 2 TB.
+    uint32_t sector = (offset_high << (32 - SD_SECTOR_SHIFT)) | (ior->io_Offset >> SD_SECTOR_SHIFT);
+
+    if (ior->io_Command == HD_SCSICMD)
+        scsi_command(ior);
+    else if (offset_high >> SD_SECTOR_SHIFT)
+        ior->io_Error = IOERR_BADADDRESS;
+    else if (!card_present)
         ior->io_Error = TDERR_DiskChanged;
     else if (!card_opened)
         ior->io_Error = TDERR_NotSpecified;
@@ -161,14 +707,20 @@ static void process_request(struct IOStdReq *ior)
 
         case TD_FORMAT:
         case CMD_WRITE:
-            if (sd_write((uint8_t *)ior->io_Data, ior->io_Offset >> SD_SECTOR_SHIFT, ior->io_Length >> SD_SECTOR_SHIFT) == 0)
+        case TD_FORMAT64:
+        case TD_WRITE64:
+        case NSCMD_TD_FORMAT64:
+        case NSCMD_TD_WRITE64:
+            if (sd_write((uint8_t *)ior->io_Data, sector, ior->io_Length >> SD_SECTOR_SHIFT) == 0)
                 ior->io_Actual = ior->io_Length;
             else
                 ior->io_Error = TDERR_NotSpecified;
             break;
 
         case CMD_READ:
-            if (sd_read((uint8_t *)ior->io_Data, ior->io_Offset >> SD_SECTOR_SHIFT, ior->io_Length >> SD_SECTOR_SHIFT) == 0)
+        case TD_READ64:
+        case NSCMD_TD_READ64:
+            if (sd_read((uint8_t *)ior->io_Data, sector, ior->io_Length >> SD_SECTOR_SHIFT) == 0)
                 ior->io_Actual = ior->io_Length;
             else
                 ior->io_Error = TDERR_NotSpecified;
@@ -179,38 +731,113 @@ static void process_request(struct IOStdReq *ior)
     ReplyMsg(&ior->io_Message);
 }
 
+static void start_probe()
+{
+    probe_tr.tr_node.io_Command = TR_ADDREQUEST;
+    probe_tr.tr_time.tv_secs = probe_interval / 1000000;
+    probe_tr.tr_time.tv_micro = probe_interval % 1000000;
+    SendIO((struct IORequest *)&probe_tr);
+}
+
+// There is no card detect line, so check if a card answers: an opened
+// card must answer SEND_STATUS, otherwise look for one in idle state.
+static void probe_card()
+{
+    BOOL present = sd_probe() == 1;
+
+    // A single missed SEND_STATUS is not enough to drop a mounted card,
+    // probe again at the minimum interval until it fails repeatedly.
+    if (!present && card_present && ++probe_failures < PROBE_FAILURES)
+    {
+        probe_interval = PROBE_MIN_US;
+        return;
+    }
+
+    probe_failures = 0;
+
+    if (present == card_present)
+    {
+        // A card that answers but could not be brought up is tried again,
+        // as often as it is probed.
+        if (present && !card_opened)
+        {
+            if (open_card() == 0)
+            {
+                card_opened = TRUE;
+                notify_change();
+            }
+            else
+                sd_close();
+        }
+
+        if (probe_interval < PROBE_MAX_US)
+            probe_interval <<= 1;
+        return;
+    }
+
+    handle_changed(present);
+    probe_interval = PROBE_MIN_US;
+}
+
 static void task_run()
 {
-    if (card_present && sd_open() == 0)
+    card_present = sd_probe() == 1;
+
+    if (card_present && open_card() == 0)
+    {
         card_opened = TRUE;
+
+        // Mount the partitions on the card. This can run before the device
+        // is in the device list (init_device is still waiting for us when
+        // booting), the nodes are added without ADNF_STARTPROC so the
+        // device only has to be listed when a handler first opens it.
+        mount_partitions(device_name, 0);
+    }
+
+    // Let init_device return once the boot nodes are in the mount list
+    if (boot_task)
+    {
+        Signal(boot_task, SIGF_SINGLE);
+        boot_task = NULL;
+    }
      
+    start_probe();
+
     while (1)
     {
-        ULONG sigs = Wait(SIGF_CARD_CHANGE | SIGF_OP_REQUEST);
+        ULONG sigs = Wait(SIGF_PROBE | SIGF_OP_REQUEST | SIGF_QUIT);
 
-        if (sigs & SIGF_CARD_CHANGE)
-            handle_changed();
+        if (sigs & SIGF_QUIT)
+        {
+            // The probe request is either running or replied and still in
+            // the port, it is only taken from the port below.
+            if (!CheckIO((struct IORequest *)&probe_tr))
+                AbortIO((struct IORequest *)&probe_tr);
+            WaitIO((struct IORequest *)&probe_tr);
+
+            spi_shutdown();
+
+            // The task is gone before expunge gets to run again
+            Forbid();
+            Signal(expunge_task, SIGF_SINGLE);
+            return;
+        }
 
         if (sigs & SIGF_OP_REQUEST)
         {
-            BOOL first = TRUE;
-
             struct IOStdReq *ior;
             while ((ior = (struct IOStdReq *)GetMsg(&mp)))
-            {
-                if (!first && (SetSignal(0, SIGF_CARD_CHANGE) & SIGF_CARD_CHANGE))
-                    handle_changed();
-
                 process_request(ior);
-                first = FALSE;
-            }
+
+            probe_interval = PROBE_MIN_US;
         }
-    }
-}
 
-static void change_isr()
-{
-    Signal(task, SIGF_CARD_CHANGE);
+        if ((sigs & SIGF_PROBE) && GetMsg(&probe_mp))
+        {
+            probe_card();
+            start_probe();
+        }
+    }
 }
 
 static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdReq *ior)
@@ -219,7 +846,8 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
         return;
 
     ior->io_Error = 0;
-    ior->io_Actual = 0;
+    if (!is_64bit_command(ior->io_Command))
+        ior->io_Actual = 0;
 
     switch (ior->io_Command)
     {
@@ -230,6 +858,15 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
     case TD_PROTSTATUS:
         break;
 
+    case TD_SEEK64:
+    case NSCMD_TD_SEEK64:
+        ior->io_Actual = 0;
+        break;
+
+    case NSCMD_DEVICEQUERY:
+        device_query(ior);
+        break;
+
     case TD_CHANGESTATE:
         ior->io_Actual = card_present ? 0 : 1;
         break;
@@ -266,6 +903,13 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
     case TD_FORMAT:
     case CMD_WRITE:
     case CMD_READ:
+    case TD_FORMAT64:
+    case TD_WRITE64:
+    case TD_READ64:
+    case NSCMD_TD_FORMAT64:
+    case NSCMD_TD_WRITE64:
+    case NSCMD_TD_READ64:
+    case HD_SCSICMD:
         PutMsg(&mp, (struct Message *)&ior->io_Message);
         ior->io_Flags &= ~IOF_QUICK;
         ior = NULL;
@@ -295,26 +939,45 @@ static struct Library *init_device(__reg("a6") struct ExecBase *sys_base, __reg(
     dev->lib_Version = DEVICE_VERSION;
     dev->lib_Revision = DEVICE_REVISION;
     dev->lib_IdString = (APTR)id_string;
-    
+
+#ifdef SSPI_USE_LIBRARY
+    // Outside the Forbid, loading the library from libs: would break it.
+    SSPIBase = OpenLibrary(SSPI_LIBRARY_NAME, SSPI_LIBRARY_VERSION);
+    if (!SSPIBase)
+    {
+        ERROR("%s version %d not found\n", SSPI_LIBRARY_NAME, SSPI_LIBRARY_VERSION);
+
+        // Before DOS there is no libs: to load it from, so the library was
+        // not kept resident with the device. Nothing else would tell.
+        if (FindName(&SysBase->LibList, DOSNAME) == NULL)
+            Alert(AG_OpenLib | AO_Unknown);
+        goto fail0;
+    }
+#endif
+
     Forbid();
 
     tr.tr_node.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
     tr.tr_node.io_Message.mn_ReplyPort = &timer_mp;
     tr.tr_node.io_Message.mn_Length = sizeof(tr);
 
-    if (OpenDevice(TIMERNAME, UNIT_VBLANK, (struct IORequest *)&tr, 0))
+    if (OpenDevice(TIMERNAME, UNIT_MICROHZ, (struct IORequest *)&tr, 0))
         goto fail1;
 
-    task = CreateTask(device_name, TASK_PRIORITY, (char *)&task_run, TASK_STACK_SIZE);
-    if (!task)
+    probe_tr = tr;
+    probe_tr.tr_node.io_Message.mn_ReplyPort = &probe_mp;
+
+    timer_init();
+
+    // The bus is set up before the task can run and use it.
+    if (spi_initialize(SPI_CHANNEL_1) < 0)
         goto fail2;
+    spi_set_max_hold(BUS_MAX_HOLD_US);
 
-    int res = spi_initialize(SPI_CHANNEL_1);
-    if (res < 0)
+    task = CreateTask(device_name, TASK_PRIORITY, (char *)&task_run, TASK_STACK_SIZE);
+    if (!task)
         goto fail3;
 
-    card_present = res == 1;
-	 
     mp.mp_Node.ln_Type = NT_MSGPORT;
     mp.mp_Flags = PA_SIGNAL;
     mp.mp_SigBit = SIGB_OP_REQUEST;
@@ -327,17 +990,42 @@ static struct Library *init_device(__reg("a6") struct ExecBase *sys_base, __reg(
     timer_mp.mp_SigTask = task;
     NewList(&timer_mp.mp_MsgList);
 
+    probe_mp.mp_Node.ln_Type = NT_MSGPORT;
+    probe_mp.mp_Flags = PA_SIGNAL;
+    probe_mp.mp_SigBit = SIGB_PROBE;
+    probe_mp.mp_SigTask = task;
+    NewList(&probe_mp.mp_MsgList);
+
+    // When initialized as a resident before DOS is up the partitions must
+    // be in the mount list before strap runs, so wait for the task.
+    BOOL booting = FindName(&SysBase->LibList, DOSNAME) == NULL;
+    if (booting)
+    {
+        boot_task = FindTask(NULL);
+        SetSignal(0, SIGF_SINGLE);
+    }
+
     Permit();
+
+    if (booting)
+        Wait(SIGF_SINGLE);
+
     return dev;
 
 fail3:
-    DeleteTask(task);
+    spi_shutdown();
 
 fail2:
     CloseDevice((struct IORequest *)&tr);
 
 fail1:
     Permit();
+
+#ifdef SSPI_USE_LIBRARY
+    CloseLibrary(SSPIBase);
+
+fail0:
+#endif
     FreeMem((char *)dev - dev->lib_NegSize, dev->lib_NegSize + dev->lib_PosSize);
     return NULL;
 }
@@ -350,15 +1038,20 @@ static BPTR expunge(__reg("a6") struct Library *dev)
         return 0;
     }
 
-    // This could be improved on.
-    // There is a risk that the task has an outstanding debounce timer,
-    // and deleting the task at that point will probably cause a crash.
+    // The task stops its probe timer, gives the bus back and ends itself,
+    // it could be waiting for the bus or hold it right now.
+    expunge_task = FindTask(NULL);
+    SetSignal(0, SIGF_SINGLE);
+    Signal(task, SIGF_QUIT);
+    Wait(SIGF_SINGLE);
 
-    spi_shutdown();
+    CloseDevice((struct IORequest *)&tr);
 
-    DeleteTask(task);
+#ifdef SSPI_USE_LIBRARY
+    CloseLibrary(SSPIBase);
+#endif
 
-    CloseDevice((struct IORequest *)&tr);
+    timer_shutdown();
 
     BPTR seg_list = saved_seg_list;
     Remove(&dev->lib_Node);
@@ -0,0 +1,406 @@
+/*
+ *  Partition mounting for the A500 Simple SPI SD device driver
+ *
+ *  The first RDB_SCAN_BLOCKS sectors of the card are read with a single
+ *  multi-block command and searched for a Rigid Disk Block. Every partition
+ *  in its partition list gets a DOS node. Cards without an RDB are checked
+ *  for an MBR. Its Amiga (type 0x76) partitions can hold an RDB of their
+ *  own (Amithlon, Emu68), otherwise they are mounted directly.
+ *
+ *  When the device is initialized before DOS is running (from a ROM build
+ *  or a resident kept over reset with LoadModule) the partitions are
+ *  enqueued as boot nodes in the expansion mount list instead, so that
+ *  strap can boot from the bootable one with the highest priority.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <proto/exec.h>
+#include <proto/expansion.h>
+#include <exec/memory.h>
+#include <devices/hardblocks.h>
+#include <libraries/expansion.h>
+#include <libraries/expansionbase.h>
+#include <libraries/configvars.h>
+#include <dos/dos.h>
+#include <dos/filehandler.h>
+#include <resources/filesysres.h>
+#include <string.h>
+
+#include "common.h"
+#include "sd.h"
+#include "mount.h"
+
+#define RDB_SCAN_BLOCKS         RDB_LOCATION_LIMIT
+#define MAX_PARTITIONS          32
+
+#define MBR_PARTITION_OFFSET    446
+#define MBR_SIGNATURE_OFFSET    510
+#define MBR_PARTITIONS          4
+#define MBR_TYPE_AMIGA          0x76
+
+#define DEFAULT_DOSTYPE         0x444f5301  // DOS\1
+#define DEFAULT_NUMBUFFERS      30
+#define DEFAULT_MAXTRANSFER     0x1fe00
+
+#define BOOTPRI_NOBOOT          -128
+
+// Manufacturer/product of the fake ConfigDev the boot nodes point to
+#define BOOT_MANUFACTURER       0x0539
+#define BOOT_PRODUCT            0x01
+
+struct Library *ExpansionBase;
+
+// Boot area in romtag.asm, strap calls its boot point to start DOS
+extern struct DiagArea diag_area;
+
+static struct ConfigDev *boot_config_dev;
+
+// Before DOS has been initialized partitions are enqueued as boot nodes.
+static BOOL dos_running()
+{
+    struct Node *node;
+
+    Forbid();
+    node = FindName(&SysBase->LibList, DOSNAME);
+    Permit();
+
+    return node != NULL;
+}
+
+// KS 1.3 strap only boots from nodes that point to a ConfigDev with a
+// valid DiagArea, so create one for the card.
+static struct ConfigDev *get_config_dev()
+{
+    struct ConfigDev *cd = boot_config_dev;
+
+    if (cd)
+        return cd;
+
+    cd = AllocMem(sizeof(struct ConfigDev), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!cd)
+        return NULL;
+
+    cd->cd_Rom.er_Type = ERTF_DIAGVALID;
+    cd->cd_Rom.er_Manufacturer = BOOT_MANUFACTURER;
+    cd->cd_Rom.er_Product = BOOT_PRODUCT;
+    *(ULONG *)&cd->cd_Rom.er_Reserved0c = (ULONG)&diag_area;
+    AddConfigDev(cd);
+
+    boot_config_dev = cd;
+    return cd;
+}
+
+static BOOL add_boot_node(LONG bootpri, struct DeviceNode *node)
+{
+    struct ConfigDev *cd = get_config_dev();
+    struct BootNode *bn;
+
+    if (ExpansionBase->lib_Version >= 36)
+        return AddBootNode(bootpri, 0, node, cd);
+
+    bn = AllocMem(sizeof(struct BootNode), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!bn)
+        return FALSE;
+
+    bn->bn_Node.ln_Type = NT_BOOTNODE;
+    bn->bn_Node.ln_Pri = bootpri;
+    bn->bn_Node.ln_Name = (char *)cd;
+    bn->bn_DeviceNode = node;
+
+    Forbid();
+    Enqueue(&((struct ExpansionBase *)ExpansionBase)->MountList, &bn->bn_Node);
+    Permit();
+
+    return TRUE;
+}
+
+// Returns block <block> of the RDB that starts <offset> sectors into the
+// card. Blocks outside the scanned area are read into the spare block at
+// the end of the scan buffer.
+static ULONG *get_block(UBYTE *buf, ULONG offset, ULONG block)
+{
+    UBYTE *spare = buf + (RDB_SCAN_BLOCKS << SD_SECTOR_SHIFT);
+
+    if (offset == 0 && block < RDB_SCAN_BLOCKS)
+        return (ULONG *)(buf + (block << SD_SECTOR_SHIFT));
+
+    if (sd_read(spare, offset + block, 1) != 0)
+        return NULL;
+
+    return (ULONG *)spare;
+}
+
+// RDB blocks sum to zero over their first SummedLongs longwords.
+static BOOL checksum_ok(const ULONG *block)
+{
+    ULONG summed = block[1];
+    ULONG sum = 0;
+    ULONG i;
+
+    if (summed < 3 || summed > (SD_SECTOR_SIZE >> 2))
+        return FALSE;
+
+    for (i = 0; i < summed; i++)
+        sum += block[i];
+
+    return sum == 0;
+}
+
+// Use the filesystem registered in FileSystem.resource for this dos type,
+// like the boot code does for autobooting partitions (2.0+ only).
+static void patch_filesystem(struct DeviceNode *node, ULONG dostype)
+{
+    struct FileSysResource *fsr = OpenResource(FSRNAME);
+    struct FileSysEntry *fse;
+    ULONG *src, *dst;
+    int i;
+
+    if (!fsr)
+        return;
+
+    Forbid();
+    for (fse = (struct FileSysEntry *)fsr->fsr_FileSysEntries.lh_Head; fse->fse_Node.ln_Succ; fse = (struct FileSysEntry *)fse->fse_Node.ln_Succ)
+    {
+        if (fse->fse_DosType == dostype)
+        {
+            src = (ULONG *)&fse->fse_Type;
+            dst = (ULONG *)&node->dn_Type;
+            for (i = 0; i < 9; i++)
+            {
+                if (fse->fse_PatchFlags & (1 << i))
+                    dst[i] = src[i];
+            }
+            break;
+        }
+    }
+    Permit();
+}
+
+static BOOL add_partition(char *name, const ULONG *envec, BOOL bootable, char *device, ULONG unit)
+{
+    ULONG packet[4 + DE_BOOTBLOCKS + 1];
+    ULONG size = MIN(envec[DE_TABLESIZE], DE_BOOTBLOCKS);
+    struct DeviceNode *node;
+    LONG bootpri;
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = (ULONG)name;
+    packet[1] = (ULONG)device;
+    packet[2] = unit;
+    packet[3] = 0;
+    memcpy(&packet[4], envec, (size + 1) * sizeof(ULONG));
+    packet[4 + DE_TABLESIZE] = size;
+
+    node = MakeDosNode(packet);
+    if (!node)
+        return FALSE;
+
+    patch_filesystem(node, size >= DE_DOSTYPE ? packet[4 + DE_DOSTYPE] : ID_DOS_DISK);
+
+    bootpri = size >= DE_BOOTPRI ? (LONG)packet[4 + DE_BOOTPRI] : 0;
+    if (!bootable || bootpri < BOOTPRI_NOBOOT)
+        bootpri = BOOTPRI_NOBOOT;
+
+    INFO("mounting %s (boot priority %ld)\n", name, bootpri);
+
+    if (!dos_running())
+        return add_boot_node(bootpri, node);
+
+    // The handler is started on first reference, this runs before the
+    // device is in the device list and not from a DOS process.
+    return AddDosNode(bootpri, 0, node);
+}
+
+// Moves the partition in <envec> <offset> sectors further into the card.
+// When that is not a whole number of its cylinders they are made one block
+// each, the layout of the blocks stays the same.
+static BOOL rebase_partition(ULONG *envec, ULONG offset)
+{
+    ULONG blksectors = (envec[DE_SIZEBLOCK] << 2) >> SD_SECTOR_SHIFT;
+    ULONG cylblocks = envec[DE_NUMHEADS] * envec[DE_BLKSPERTRACK];
+
+    if (!blksectors || !cylblocks || offset % blksectors)
+        return FALSE;
+
+    if (offset % (cylblocks * blksectors) == 0)
+    {
+        envec[DE_LOWCYL] += offset / (cylblocks * blksectors);
+        envec[DE_UPPERCYL] += offset / (cylblocks * blksectors);
+        return TRUE;
+    }
+
+    envec[DE_LOWCYL] = envec[DE_LOWCYL] * cylblocks + offset / blksectors;
+    envec[DE_UPPERCYL] = (envec[DE_UPPERCYL] + 1) * cylblocks - 1 + offset / blksectors;
+    envec[DE_NUMHEADS] = 1;
+    envec[DE_BLKSPERTRACK] = 1;
+    return TRUE;
+}
+
+// Mounts the partitions of the RDB that starts <offset> sectors into the
+// card, its block numbers and cylinders count from there.
+static int mount_rdb(UBYTE *buf, const struct RigidDiskBlock *rdb, ULONG offset, char *device, ULONG unit)
+{
+    const struct PartitionBlock *pb;
+    ULONG block = rdb->rdb_PartitionList;
+    ULONG envec[DE_BOOTBLOCKS + 1];
+    char name[32];
+    int count = 0;
+    int n;
+
+    for (n = 0; n < MAX_PARTITIONS && block != 0xffffffff; n++)
+    {
+        pb = (const struct PartitionBlock *)get_block(buf, offset, block);
+        if (!pb || pb->pb_ID != IDNAME_PARTITION || !checksum_ok((const ULONG *)pb))
+        {
+            ERROR("bad partition block %lu\n", block);
+            break;
+        }
+        block = pb->pb_Next;
+
+        if (pb->pb_Flags & PBFF_NOMOUNT)
+            continue;
+
+        // Drive name is a BSTR
+        memcpy(name, &pb->pb_DriveName[1], MIN(pb->pb_DriveName[0], sizeof(name) - 1));
+        name[MIN(pb->pb_DriveName[0], sizeof(name) - 1)] = 0;
+
+        memcpy(envec, pb->pb_Environment, sizeof(envec));
+        if (offset && !rebase_partition(envec, offset))
+        {
+            ERROR("cannot place partition %s\n", name);
+            continue;
+        }
+
+        if (add_partition(name, envec, (pb->pb_Flags & PBFF_BOOTABLE) != 0, device, unit))
+            count++;
+    }
+
+    return count;
+}
+
+static int mount_mbr(UBYTE *buf, char *device, ULONG unit)
+{
+    const UBYTE *entry;
+    const ULONG *boot;
+    const struct RigidDiskBlock *rdb;
+    ULONG envec[DE_BOOTBLOCKS + 1];
+    ULONG start, size, dostype;
+    char name[] = "SD0";
+    int count = 0;
+    int i;
+
+    if (buf[MBR_SIGNATURE_OFFSET] != 0x55 || buf[MBR_SIGNATURE_OFFSET + 1] != 0xaa)
+        return 0;
+
+    for (i = 0; i < MBR_PARTITIONS; i++)
+    {
+        entry = &buf[MBR_PARTITION_OFFSET + i * 16];
+        if (entry[4] != MBR_TYPE_AMIGA)
+            continue;
+
+        // Little endian start and size
+        start = entry[8] | ((ULONG)entry[9] << 8) | ((ULONG)entry[10] << 16) | ((ULONG)entry[11] << 24);
+        size = entry[12] | ((ULONG)entry[13] << 8) | ((ULONG)entry[14] << 16) | ((ULONG)entry[15] << 24);
+        if (size == 0)
+            continue;
+
+        // The partition can be a disk of its own with an RDB at the start
+        boot = get_block(buf, start, 0);
+        if (boot && boot[0] == IDNAME_RIGIDDISK)
+        {
+            rdb = (const struct RigidDiskBlock *)boot;
+            if (checksum_ok(boot) && rdb->rdb_BlockBytes == SD_SECTOR_SIZE)
+                count += mount_rdb(buf, rdb, start, device, unit);
+            else
+                ERROR("bad RDB in partition %d\n", i);
+            continue;
+        }
+
+        // Take the dos type from the boot block when it looks like one
+        dostype = DEFAULT_DOSTYPE;
+        if (boot)
+        {
+            const UBYTE *id = (const UBYTE *)boot;
+            if (id[0] >= 'A' && id[0] <= 'Z' && id[1] >= 'A' && id[1] <= 'Z' && id[2] >= 'A' && id[2] <= 'Z')
+                dostype = boot[0];
+        }
+
+        memset(envec, 0, sizeof(envec));
+        envec[DE_TABLESIZE] = DE_BOOTBLOCKS;
+        envec[DE_SIZEBLOCK] = SD_SECTOR_SIZE >> 2;
+        envec[DE_NUMHEADS] = 1;
+        envec[DE_SECSPERBLK] = 1;
+        envec[DE_BLKSPERTRACK] = 1;
+        envec[DE_RESERVEDBLKS] = 2;
+        envec[DE_LOWCYL] = start;
+        envec[DE_UPPERCYL] = start + size - 1;
+        envec[DE_NUMBUFFERS] = DEFAULT_NUMBUFFERS;
+        envec[DE_MEMBUFTYPE] = MEMF_PUBLIC;
+        envec[DE_MAXTRANSFER] = DEFAULT_MAXTRANSFER;
+        envec[DE_MASK] = 0xfffffffe;
+        envec[DE_DOSTYPE] = dostype;
+        envec[DE_BOOTBLOCKS] = 2;
+
+        name[2] = '0' + i;
+        // Only the active partition is bootable
+        if (add_partition(name, envec, (entry[0] & 0x80) != 0, device, unit))
+            count++;
+    }
+
+    return count;
+}
+
+int mount_partitions(char *device, ULONG unit)
+{
+    ULONG bufsize = (RDB_SCAN_BLOCKS + 1) << SD_SECTOR_SHIFT;
+    const struct RigidDiskBlock *rdb;
+    UBYTE *buf;
+    int count = 0;
+    int i;
+
+    ExpansionBase = OpenLibrary(EXPANSIONNAME, 0);
+    if (!ExpansionBase)
+        return 0;
+
+    buf = AllocMem(bufsize, MEMF_PUBLIC);
+    if (!buf)
+        goto done;
+
+    // One multi-block read for the whole RDB search area
+    if (sd_read(buf, 0, RDB_SCAN_BLOCKS) != 0)
+        goto done;
+
+    for (i = 0; i < RDB_SCAN_BLOCKS; i++)
+    {
+        rdb = (const struct RigidDiskBlock *)(buf + (i << SD_SECTOR_SHIFT));
+        if (rdb->rdb_ID == IDNAME_RIGIDDISK && checksum_ok((const ULONG *)rdb))
+            break;
+    }
+
+    if (i < RDB_SCAN_BLOCKS)
+    {
+        if (rdb->rdb_BlockBytes == SD_SECTOR_SIZE)
+            count = mount_rdb(buf, rdb, 0, device, unit);
+    }
+    else
+        count = mount_mbr(buf, device, unit);
+
+done:
+    if (buf)
+        FreeMem(buf, bufsize);
+    CloseLibrary(ExpansionBase);
+
+    return count;
+}
@@ -0,0 +1,33 @@
+/*
+ *  Partition mounting for the A500 Simple SPI SD device driver
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOUNT_H_
+#define MOUNT_H_
+
+#include <exec/types.h>
+
+/*!
+ * Scans the card for a Rigid Disk Block (or, failing that, an MBR with
+ * Amiga partitions) and adds a DOS node for every partition found.
+ *
+ * \param device		Exec device name the partitions are mounted on
+ * \param unit			Unit number of the card
+ * \return				Number of partitions mounted
+ */
+int mount_partitions(char *device, ULONG unit);
+
+#endif /* MOUNT_H_ */
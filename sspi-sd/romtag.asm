@@ -1,8 +1,16 @@
 RTC_MATCHWORD:	equ	$4afc
 RTF_AUTOINIT:	equ	(1<<7)
+RTF_COLDSTART:	equ	(1<<0)
 NT_DEVICE:	equ	3
 VERSION:		equ   1
-PRIORITY:	equ	0
+PRIORITY:	equ	10
+
+DAC_WORDWIDE:	equ	$40
+DAC_CONFIGTIME:	equ	$10
+RT_INIT:		equ	22
+_LVOFindResident:	equ	-96
+
+		XDEF	_diag_area
 
 		section	code,code
 
@@ -13,7 +21,7 @@ romtag:
 		dc.w	RTC_MATCHWORD
 		dc.l	romtag
 		dc.l	endcode
-		dc.b	RTF_AUTOINIT
+		dc.b	RTF_AUTOINIT|RTF_COLDSTART
 		dc.b	VERSION
 		dc.b	NT_DEVICE
 		dc.b	PRIORITY
@@ -21,3 +29,31 @@ romtag:
 		dc.l	_id_string
 		dc.l	_auto_init_tables
 endcode:
+
+; DiagArea for the boot nodes of the card, strap calls the boot point
+; with a6 = SysBase to start dos.library from the chosen partition
+_diag_area:
+		dc.b	DAC_WORDWIDE|DAC_CONFIGTIME	; da_Config
+		dc.b	0				; da_Flags
+		dc.w	diag_end-_diag_area		; da_Size
+		dc.w	0				; da_DiagPoint
+		dc.w	boot_point-_diag_area		; da_BootPoint
+		dc.w	diag_name-_diag_area		; da_Name
+		dc.w	0				; da_Reserved01
+		dc.w	0				; da_Reserved02
+
+boot_point:
+		lea	dos_name(pc),a1
+		jsr	_LVOFindResident(a6)
+		tst.l	d0
+		beq.s	.no_dos
+		move.l	d0,a0
+		move.l	RT_INIT(a0),a0
+		jsr	(a0)
+.no_dos:
+		rts
+
+dos_name:	dc.b	'dos.library',0
+diag_name:	dc.b	'sspisd.device',0
+		even
+diag_end:
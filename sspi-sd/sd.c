@@ -36,7 +36,17 @@
 
 #define READY_TIMEOUT_MS    500
 #define INIT_TIMEOUT_MS        1000
+#define INIT_POLL_MS        5
+#define RESET_DELAY_MS        20
 #define MAX_RESPONSE_POLLS    10
+#define TOKEN_SCAN_POLLS    64    /* bytes polled for a data token between timeout checks */
+#define CRC_RETRIES            3
+#define YIELD_BLOCKS        8    /* blocks streamed between spi_yield_due() checks */
+
+#ifndef SD_CRC_CHECK
+/* Default for CRC checking of commands and data, see sd_set_crc() */
+#define SD_CRC_CHECK        0
+#endif
 
 /* MMC/SD command */
 #define CMD0    (0)            /* GO_IDLE_STATE */
@@ -46,6 +56,7 @@
 #define CMD9    (9)            /* SEND_CSD */
 #define CMD10    (10)        /* SEND_CID */
 #define CMD12    (12)        /* STOP_TRANSMISSION */
+#define CMD13    (13)        /* SEND_STATUS */
 #define ACMD13    (0x80+13)    /* SD_STATUS (SDC) */
 #define CMD16    (16)        /* SET_BLOCKLEN */
 #define CMD17    (17)        /* READ_SINGLE_BLOCK */
@@ -59,8 +70,54 @@
 #define CMD38    (38)        /* ERASE */
 #define CMD55    (55)        /* APP_CMD */
 #define CMD58    (58)        /* READ_OCR */
+#define CMD59    (59)        /* CRC_ON_OFF */
+
+/* CRC16-CCITT kernel in sd_crc.asm */
+extern uint16_t sd_crc16(__reg("a0") const uint8_t *buf, __reg("d0") uint16_t size);
 
 static sd_card_info_t sd_card_info;
+static int sd_crc_enabled = SD_CRC_CHECK;    /*!< CRC checking requested */
+static int sd_crc_active;                    /*!< CRC checking enabled on the card */
+static int sd_in_sequence;                   /*!< bus obtained by sd_select() */
+
+/* Card bring-up states, see sd_open_step() */
+typedef enum {
+    sdOpen_Reset = 0,
+    sdOpen_Identify,
+    sdOpen_WaitReady,
+    sdOpen_Done,
+} sd_open_state_t;
+
+static sd_open_state_t sd_open_state = sdOpen_Done;
+static uint8_t sd_init_cmd;                  /*!< command polled until the card is ready */
+static uint32_t sd_init_arg;
+static uint32_t sd_init_start;               /*!< time in us polling for ready started */
+
+static int sd_info_loaded;                   /*!< CID/CSD decoded since bring-up */
+static int sd_csd_cached;                    /*!< sd_csd_cache belongs to sd_cid_cache */
+static uint32_t sd_cid_cache[4];             /*!< CID of the last card seen */
+static uint32_t sd_csd_cache[4];
+
+/*! CRC7 of a command, returned as the last command byte (with end bit) */
+static uint8_t sd_crc7(const uint8_t *buf, unsigned int size)
+{
+    uint8_t crc = 0;
+    uint8_t data;
+    int n;
+
+    while (size--) {
+        data = *buf++;
+        for (n = 0; n < 8; n++) {
+            crc <<= 1;
+            if ((data ^ crc) & 0x80) {
+                crc ^= 0x09;
+            }
+            data <<= 1;
+        }
+    }
+
+    return (crc << 1) | 0x01;
+}
 
 /*! Utility function for parsing CSD fields */
 static int sd_parse_csd(sd_card_info_t *ci, const uint32_t *bits)
@@ -178,25 +235,27 @@ static int sd_parse_cid(sd_card_info_t *ci, const uint32_t *bits)
 
 static int sd_wait_ready(void)
 {
-    uint32_t timeout;
+    uint32_t start;
     uint8_t in;
 
-    timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
+    start = timer_get_us();
     do {
         spi_read(&in, 1);
-    } while (in != 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
+    } while (in != 0xff && timer_get_us() - start < READY_TIMEOUT_MS * 1000ul);
 
     return (in == 0xff) ? 0 : sdError_Timeout;
 }
 
 static void sd_deselect(void)
 {
-    //de-assert /CS
-    spi_deselect();
-    
-    //8 more clock cycles after de-asserting /CS to tristate MISO
-    uint8_t cmd = 0xff;
-    spi_write(&cmd,1);
+    if (!sd_in_sequence) {
+        return;
+    }
+    sd_in_sequence = 0;
+
+    //end of the sequence, /CS is de-asserted (with the trailing clocks)
+    //when the bus is released
+    spi_deselect_lazy();
     
     //release the bus now for other users
     spi_release();    
@@ -204,10 +263,14 @@ static void sd_deselect(void)
 
 static int sd_select(void)
 {
-    //obtain the bus before doing anything
-    spi_obtain();
+    //obtain the bus before doing anything, once per sequence as the
+    //obtains nest
+    if (!sd_in_sequence) {
+        spi_obtain();
+        sd_in_sequence = 1;
+    }
     
-    //assert /CS and wait for card ready
+    //assert /CS (if it is not already) and wait for card ready
     spi_select();
     if (sd_wait_ready() == 0) {
         return 0;
@@ -223,28 +286,101 @@ static int sd_select(void)
 static int sd_read_block(uint8_t *buf, unsigned int size)
 {
     uint32_t timeout;
-    uint8_t token, crc[2];
+    uint8_t token;
+    uint16_t crc;
 
     /* Wait for data start token */
-    timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
+    timeout = timer_get_us();
     do {
-        spi_read(&token, 1);
-    } while (token == 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
-    if (token != 0xfe) {
+        token = spi_scan(TOKEN_SCAN_POLLS);
+    } while (token == 0xff && timer_get_us() - timeout < READY_TIMEOUT_MS * 1000ul);
+    if (token == 0xff) {
         ERROR("No data token received\n");
         return sdError_Timeout;
     }
+    if (token != 0xfe) {
+        ERROR("Data error token %02X\n", token);
+        return sdError_BadResponse;
+    }
 
     /* Read data */
-    spi_read(buf, size);
-    spi_read(crc, 2);
+    if (size == SD_SECTOR_SIZE) {
+        spi_read_512(buf);
+    } else {
+        spi_read(buf, size);
+    }
+    if (!sd_crc_active) {
+        spi_skip(2);
+        return 0;
+    }
+    spi_read_2((uint8_t*)&crc); /* big endian, like the card sends it */
+
+    if (sd_crc16(buf, size) != crc) {
+        ERROR("Data CRC error\n");
+        return sdError_CRC;
+    }
+
+    return 0;
+}
+
+/*! Receive <count> data blocks, streaming as many as possible through the
+ *  SPI kernel and using sd_read_block for any block it could not handle.
+ *  Stops early when another user of the bus is due, the caller ends the
+ *  command and continues from there. <done> returns the number of good
+ *  blocks. */
+static int sd_read_blocks(uint8_t *buf, uint32_t count, uint32_t *done)
+{
+    uint16_t n, left, crc;
+    uint8_t token;
+    int err;
+
+    *done = 0;
+    while (count) {
+        if (sd_crc_active) {
+            /* Check each block before the next one is received */
+            n = 1;
+            left = spi_read_blocks(buf, 1, &crc, &token);
+            if (left == 0 && sd_crc16(buf, SD_SECTOR_SIZE) != crc) {
+                ERROR("Data CRC error\n");
+                return sdError_CRC;
+            }
+        } else {
+            n = (uint16_t)MIN(count, YIELD_BLOCKS);
+            left = spi_read_blocks(buf, n, NULL, &token);
+        }
+        buf += (uint32_t)(n - left) << SD_SECTOR_SHIFT;
+        count -= n - left;
+        *done += n - left;
+
+        /* Let a higher priority user of the bus in after this command */
+        if (count && !left && spi_yield_due()) {
+            break;
+        }
+
+        if (left && token != 0xff) {
+            /* The kernel stopped at an error token, it is not sent again */
+            ERROR("Data error token %02X\n", token);
+            return sdError_BadResponse;
+        }
+
+        if (left) {
+            /* Token is late or the kernel cannot be used, wait for it */
+            err = sd_read_block(buf, SD_SECTOR_SIZE);
+            if (err < 0) {
+                return err;
+            }
+            buf += SD_SECTOR_SIZE;
+            count--;
+            (*done)++;
+        }
+    }
 
     return 0;
 }
 
 static int sd_write_block(const uint8_t *buf, uint8_t token)
 {
-    uint8_t crc[2] = {0xff, 0xff};
+    uint8_t crc[2];
     uint8_t resp;
 
     if (sd_wait_ready() < 0) {
@@ -255,12 +391,26 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
     /* Send token */
     spi_write(&token, 1);
     if (token != 0xfd) {
+        if (sd_crc_active) {
+            uint16_t sum = sd_crc16(buf, SD_SECTOR_SIZE);
+            crc[0] = (uint8_t)(sum >> 8);
+            crc[1] = (uint8_t)sum;
+        }
+
         /* Send data, except for STOP_TRAN */
-        spi_write(buf, SD_SECTOR_SIZE);
-        spi_write(crc, 2); /* dummy */
+        spi_write_512(buf);
+        if (sd_crc_active) {
+            spi_write_2(crc);
+        } else {
+            spi_clock(2); /* dummy CRC */
+        }
 
         /* Receive data response */
         spi_read(&resp, 1);
+        if ((resp & 0x1f) == 0x0b) {
+            ERROR("Data CRC error\n");
+            return sdError_CRC;
+        }
         if ((resp & 0x1f) != 0x05) {
             ERROR("Bad response\n");
             return sdError_BadResponse;
@@ -270,24 +420,17 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
     return 0;
 }
 
-static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
+/*! Send one command and receive its R1 response, no ACMD prefix or resend */
+static uint8_t sd_send_cmd_once(uint8_t cmd, uint32_t arg)
 {
     uint8_t res;
     uint8_t buf[6];
     int n;
 
-    if (cmd & 0x80) {
-        /* Send CMD55 prior to ACMD */
-        cmd &= 0x7f;
-        res = sd_send_cmd(CMD55, 0);
-        if (res > 1) {
-            return res;
-        }
-    }
-
-    /* Select the card and wait for ready except for abort */
+    /* Select the card and wait for ready except for abort, within a
+       sequence the bus and /CS are kept, the card does not need a /CS edge
+       between commands */
     if (cmd != CMD12) {
-        sd_deselect();
         if (sd_select() < 0) {
             return 0xff;
         }
@@ -299,21 +442,25 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
     buf[2] = (uint8_t)(arg >> 16);
     buf[3] = (uint8_t)(arg >> 8);
     buf[4] = (uint8_t)(arg >> 0);
-    if (cmd == CMD0) {
+    if (sd_crc_active) {
+        buf[5] = sd_crc7(buf, 5);
+    } else if (cmd == CMD0) {
         buf[5] = 0x95; /* CRC for CMD0 */
     } else if (cmd == CMD8) {
         buf[5] = 0x87; /* CRC for CMD8 */
     } else {
         buf[5] = 0x01; /* Dummy CRC and stop */
     }
-    spi_write(buf, sizeof(buf));
+
+    spi_write_6(buf);
 
     /* Receive command response */
     if (cmd == CMD12) {
         /* Skip first byte */
-        spi_read(&res, 1);
+        spi_skip(1);
     }
 
+    res = 0xff;
     for (n = 0; n < MAX_RESPONSE_POLLS; n++) {
         spi_read(&res, 1);
         if (!(res & 0x80)) {
@@ -324,6 +471,32 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
     return res;
 }
 
+static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
+{
+    uint8_t res;
+    int retry;
+
+    for (retry = 0; ; retry++) {
+        res = 0;
+        if (cmd & 0x80) {
+            /* Send CMD55 prior to ACMD */
+            res = sd_send_cmd_once(CMD55, 0);
+        }
+        if (res <= 1) {
+            res = sd_send_cmd_once(cmd & 0x7f, arg);
+        }
+
+        /* Resend the command if the card received it corrupted, an ACMD
+           together with its CMD55 so the card does not run the plain CMD */
+        if (!sd_crc_active || (res & 0x88) != 0x08 || retry >= CRC_RETRIES) {
+            break;
+        }
+        ERROR("Command CRC error\n");
+    }
+
+    return res;
+}
+
 static uint32_t sd_get_r7_resp(void)
 {
     uint8_t buf[4];
@@ -332,153 +505,262 @@ static uint32_t sd_get_r7_resp(void)
     return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 0);
 }
 
+/*! Read a 16 byte card register (CID or CSD) */
+static int sd_read_register(uint8_t cmd, uint32_t *resp)
+{
+    int retries = 0;
+    int err;
+
+    do {
+        if (sd_send_cmd(cmd, 0) == 0) {
+            err = sd_read_block((uint8_t*)resp, 16);
+        } else {
+            err = sdError_BadResponse;
+        }
+    } while (err == sdError_CRC && ++retries <= CRC_RETRIES);
+
+    return err;
+}
+
 void delay_ms(uint32_t timeout_ms)
 {
-    uint32_t timeout = timer_get_tick_count() + TIMER_MILLIS(20);
-                
-    while ((int32_t)(timer_get_tick_count() - timeout) < 0); 
+    timer_sleep_us(timeout_ms * 1000ul);
 }
 
-int sd_open(void)
+/*! At least 74 clocks with CS high to put the card in SPI mode */
+static void sd_reset_clocks(void)
+{
+    //8 more clock cycles after de-asserting /CS to tristate MISO
+    spi_set_trailing_clocks(1);
+
+    spi_obtain();
+    spi_deselect();
+    spi_clock(10);
+    spi_release();
+}
+
+void sd_open_start(void)
 {
     sd_card_info_t *ci = &sd_card_info;
-    uint32_t timeout;
-    uint8_t cmd;
-    uint32_t resp[4];
-    int err;
 
     FUNCTION_TRACE;
 
     spi_set_speed(SPI_SPEED_SLOW);
+    sd_crc_active = 0;
+    sd_info_loaded = 0;
     ci->type = sdCardType_None;
     //ci->capacity = 0;
     ci->total_sectors = 0;
     ci->block_size = sdBlockSize_512;
+    sd_open_state = sdOpen_Reset;
+}
 
-    //reset sequence
-    spi_obtain();
-    spi_deselect();
-    cmd = 0xFF;
-    for(int i=0; i<10; i++)
-        spi_write(&cmd,1);
-    delay_ms(20);
-    
-    //start init sequence
-    if (sd_send_cmd(CMD0,0) == 1) {
-        if (sd_send_cmd(CMD8, 0x1aa) == 1) {
-            uint32_t ocr = sd_get_r7_resp();
-
-            if (ocr == 0x000001aa) {
-                TRACE("SDv2 - R7 resp = 0x%08X\n", (unsigned int) ocr);
-                ci->type = sdCardType_SD2_0;
-
-                /* Wait for card ready */
-                timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
-                while (sd_send_cmd(ACMD41, (1ul << 30)) > 0) {
-                    if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
-                        /* Init timed out - invalidate card */
-                        ERROR("Init timed out\n");
-                        ci->type = sdCardType_None;
-                    }
-                }
+int sd_open_step(uint32_t *wait_ms)
+{
+    sd_card_info_t *ci = &sd_card_info;
+    uint32_t ocr;
+    int err = sdError_Busy;
 
-                if (ci->type) {
-                    /* Read OCR */
-                    if (sd_send_cmd(CMD58, 0) == 0) {
-                        ocr = sd_get_r7_resp();
-                        if (ocr & (1ul << 30)) {
-                            /* Card is high capacity */
-                            TRACE("SDHC\n");
-                            ci->type = sdCardType_SDHC;
-                        }
-                    } else {
-                        ERROR("Failed to read OCR\n");
-                        ci->type = sdCardType_None;
-                    }
-                }
+    *wait_ms = 0;
+
+    switch (sd_open_state) {
+    case sdOpen_Reset:
+        /* Reset sequence, give the card time to settle afterwards */
+        sd_reset_clocks();
+
+        sd_open_state = sdOpen_Identify;
+        *wait_ms = RESET_DELAY_MS;
+        return sdError_Busy;
+
+    case sdOpen_Identify:
+        if (sd_send_cmd(CMD0,0) != 1) {
+            err = sdError_NoCard;
+            break;
+        }
+
+        if (sd_send_cmd(CMD8, 0x1aa) == 1) {
+            ocr = sd_get_r7_resp();
+            if (ocr != 0x000001aa) {
+                err = sdError_NoCard;
+                break;
             }
-        } else {
+            TRACE("SDv2 - R7 resp = 0x%08X\n", (unsigned int) ocr);
+            ci->type = sdCardType_SD2_0;
+            sd_init_cmd = ACMD41;
+            sd_init_arg = 1ul << 30;
+        } else if (sd_send_cmd(ACMD41, 0) <= 1) {
             /* Not SDv2 */
-            if (sd_send_cmd(ACMD41, 0) <= 1) {
-                TRACE("SDv1\n");
-                ci->type = sdCardType_SD1_x;
-                cmd = ACMD41;
+            TRACE("SDv1\n");
+            ci->type = sdCardType_SD1_x;
+            sd_init_cmd = ACMD41;
+            sd_init_arg = 0;
+        } else {
+            TRACE("MMCv3\n");
+            ci->type = sdCardType_MMC;
+            sd_init_cmd = CMD1;
+            sd_init_arg = 0;
+        }
+
+        sd_init_start = timer_get_us();
+        sd_open_state = sdOpen_WaitReady;
+        /* Fall through, the card may be ready at once */
+
+    case sdOpen_WaitReady:
+        /* Wait for card ready */
+        if (sd_send_cmd(sd_init_cmd, sd_init_arg) > 0) {
+            if (timer_get_us() - sd_init_start >= INIT_TIMEOUT_MS * 1000ul) {
+                /* Init timed out - invalidate card */
+                ERROR("Init timed out\n");
+                err = sdError_NoCard;
             } else {
-                TRACE("MMCv3\n");
-                ci->type = sdCardType_MMC;
-                cmd = CMD1;
+                *wait_ms = INIT_POLL_MS;
             }
+            break;
+        }
 
-            /* Wait for card ready */
-            timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
-            while (sd_send_cmd(cmd, 0) > 0) {
-                if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
-                    /* Init timed out - invalidate card */
-                    ERROR("Init timed out\n");
-                    ci->type = sdCardType_None;
-                }
+        if (ci->type == sdCardType_SD2_0) {
+            /* Read OCR */
+            if (sd_send_cmd(CMD58, 0) != 0) {
+                ERROR("Failed to read OCR\n");
+                err = sdError_NoCard;
+                break;
             }
-
-            if (ci->type) {
-                /* Set block length */
-                if (sd_send_cmd(CMD16, SD_SECTOR_SIZE) > 0) {
-                    ERROR("Failed to set block length\n");
-                    ci->type = sdCardType_None;
-                }
+            ocr = sd_get_r7_resp();
+            if (ocr & (1ul << 30)) {
+                /* Card is high capacity */
+                TRACE("SDHC\n");
+                ci->type = sdCardType_SDHC;
+            }
+        } else {
+            /* Set block length */
+            if (sd_send_cmd(CMD16, SD_SECTOR_SIZE) > 0) {
+                ERROR("Failed to set block length\n");
+                err = sdError_NoCard;
+                break;
             }
         }
-    }
 
-    if (ci->type) {
         INFO("SD card ready (type %u)\n", (unsigned int)ci->type);
 
-        /* Read and decode card info */
-        if (sd_send_cmd(CMD10, 0) == 0) {
-            err = sd_read_block((uint8_t*)&resp, sizeof(resp));
-            if (err < 0) {
-                ERROR("Read CID failed\n");
-            }
-        } else {
-            err = sdError_BadResponse;
-        }
-        if (err == 0) {
-            err = sd_parse_cid(ci, resp);
-        }
-        if (err == 0) {
-            if (sd_send_cmd(CMD9, 0) == 0) {
-                err = sd_read_block((uint8_t*)&resp, sizeof(resp));
-                if (err < 0) {
-                    ERROR("Read CSD failed\n");
-                }
+        /* Turn on CRC checking if requested */
+        if (sd_crc_enabled) {
+            if (sd_send_cmd(CMD59, 1) == 0) {
+                sd_crc_active = 1;
             } else {
-                err = sdError_BadResponse;
+                ERROR("Failed to enable CRC checking\n");
             }
         }
-        if (err == 0) {
-            err = sd_parse_csd(ci, resp);
-        }
 
         /* Switch to fast clock */
         spi_set_speed(SPI_SPEED_FAST);
+        sd_open_state = sdOpen_Done;
+        err = 0;
+        break;
+
+    case sdOpen_Done:
+        return ci->type ? 0 : sdError_NoCard;
+    }
+
+    if (err < 0) {
+        ci->type = sdCardType_None;
+        sd_open_state = sdOpen_Done;
+    }
+
+    sd_deselect();
+
+    return err;
+}
+
+int sd_open(void)
+{
+    uint32_t wait_ms;
+    int err;
+
+    sd_open_start();
+    while ((err = sd_open_step(&wait_ms)) == sdError_Busy) {
+        delay_ms(wait_ms);
+    }
+
+    return err;
+}
+
+void sd_close(void)
+{
+    sd_card_info.type = sdCardType_None;
+    sd_info_loaded = 0;
+    sd_open_state = sdOpen_Done;
+}
+
+int sd_probe(void)
+{
+    uint8_t res, status;
+
+    if (sd_open_state != sdOpen_Done) {
+        return 1;
+    }
+
+    if (sd_card_info.type != sdCardType_None) {
+        /* An opened card answers SEND_STATUS (R2) */
+        res = sd_send_cmd(CMD13, 0);
+        if (!(res & 0x80)) {
+            spi_read(&status, 1);
+        }
     } else {
-        /* Card not present */
-        err = sdError_NoCard;
+        /* Otherwise look for a card going to idle state */
+        spi_set_speed(SPI_SPEED_SLOW);
+        sd_reset_clocks();
+        res = sd_send_cmd(CMD0, 0);
     }
 
     sd_deselect();
 
+    return (res & 0x80) ? 0 : 1;
+}
+
+/*! Read and decode CID and CSD, the CSD of the last card seen is reused
+ *  when the CID has not changed */
+static int sd_load_card_info(void)
+{
+    sd_card_info_t *ci = &sd_card_info;
+    uint32_t resp[4];
+    int err;
+
+    err = sd_read_register(CMD10, resp);
+    if (err < 0) {
+        ERROR("Read CID failed\n");
+    } else if (sd_csd_cached && memcmp(resp, sd_cid_cache, sizeof(resp)) == 0) {
+        TRACE("Same card, using cached CSD\n");
+    } else {
+        sd_csd_cached = 0;
+        memcpy(sd_cid_cache, resp, sizeof(resp));
+        err = sd_read_register(CMD9, sd_csd_cache);
+        if (err < 0) {
+            ERROR("Read CSD failed\n");
+        } else {
+            sd_csd_cached = 1;
+        }
+    }
+
+    sd_deselect();
+
+    if (err == 0) {
+        err = sd_parse_cid(ci, sd_cid_cache);
+    }
+    if (err == 0) {
+        err = sd_parse_csd(ci, sd_csd_cache);
+    }
+
     return err;
 }
 
-int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
+/*! One read command, <done> returns the number of good sectors. That is
+ *  less than <count> without an error when the bus was due for another user. */
+static int sd_read_sectors(uint8_t *buf, uint32_t sector, uint32_t count, uint32_t *done)
 {
     sd_card_info_t *ci = &sd_card_info;
     int err = 0;
 
-    if (ci->type == sdCardType_None) {
-        ERROR("No card\n");
-        return sdError_NoCard;
-    }
+    *done = 0;
     if (ci->type != sdCardType_SDHC) {
         /* Convert sector to byte addressing (x512) */
         sector <<= 9;
@@ -487,24 +769,20 @@ int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
     if (count == 1) {
         /* Read single sector */
         if (sd_send_cmd(CMD17, sector) == 0) {
-            err = sd_read_block(buf, SD_SECTOR_SIZE);
+            err = sd_read_blocks(buf, 1, done);
         } else {
             err = sdError_BadResponse;
         }
     } else {
         /* Read multiple sectors */
         if (sd_send_cmd(CMD18, sector) == 0) {
-            do {
-                err = sd_read_block(buf, SD_SECTOR_SIZE);
-                if (err < 0) {
-                    break;
-                }
-                buf += SD_SECTOR_SIZE;
-            } while (--count);
+            err = sd_read_blocks(buf, count, done);
 
             /* Send CMD12 stop transmission */
             if (err == 0) {
                 err = sd_send_cmd(CMD12, 0);
+            } else if (err == sdError_CRC) {
+                sd_send_cmd(CMD12, 0);
             }
         } else {
             err = sdError_BadResponse;
@@ -516,15 +794,44 @@ int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
     return err;
 }
 
-int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
 {
     sd_card_info_t *ci = &sd_card_info;
-    int err = 0;
+    uint32_t done;
+    int retries = 0;
+    int err;
 
     if (ci->type == sdCardType_None) {
         ERROR("No card\n");
         return sdError_NoCard;
     }
+
+    for (;;) {
+        err = sd_read_sectors(buf, sector, count, &done);
+        if (err == 0 && done == count) {
+            break;
+        }
+        if (err != 0 && (err != sdError_CRC || ++retries > CRC_RETRIES)) {
+            break;
+        }
+
+        /* Continue after a yield or retry from the first bad sector */
+        buf += done << SD_SECTOR_SHIFT;
+        sector += done;
+        count -= done;
+    }
+
+    return err;
+}
+
+/*! One write command, <done> returns the number of sectors accepted. That is
+ *  less than <count> without an error when the bus was due for another user. */
+static int sd_write_sectors(const uint8_t *buf, uint32_t sector, uint32_t count, uint32_t *done)
+{
+    sd_card_info_t *ci = &sd_card_info;
+    int err = 0;
+
+    *done = 0;
     if (ci->type != sdCardType_SDHC) {
         /* Convert sector to byte addressing (x512) */
         sector <<= 9;
@@ -534,6 +841,9 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
         /* Write single sector */
         if (sd_send_cmd(CMD24, sector) == 0) {
             err = sd_write_block(buf, 0xfe);
+            if (err == 0) {
+                *done = 1;
+            }
         } else {
             err = sdError_BadResponse;
         }
@@ -550,11 +860,19 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
                     break;
                 }
                 buf += SD_SECTOR_SIZE;
+                (*done)++;
+
+                /* Let a higher priority user of the bus in after this command */
+                if (count > 1 && spi_yield_due()) {
+                    break;
+                }
             } while (--count);
 
             /* Send STOP_TRAN */
             if (err == 0) {
                 err = sd_write_block(0, 0xfd);
+            } else if (err == sdError_CRC) {
+                sd_write_block(0, 0xfd);
             }
         } else {
             err = sdError_BadResponse;
@@ -566,6 +884,64 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
     return err;
 }
 
+int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+    sd_card_info_t *ci = &sd_card_info;
+    uint32_t done;
+    int retries = 0;
+    int err;
+
+    if (ci->type == sdCardType_None) {
+        ERROR("No card\n");
+        return sdError_NoCard;
+    }
+
+    for (;;) {
+        err = sd_write_sectors(buf, sector, count, &done);
+        if (err == 0 && done == count) {
+            break;
+        }
+        if (err != 0 && (err != sdError_CRC || ++retries > CRC_RETRIES)) {
+            break;
+        }
+
+        /* Continue after a yield or retry from the first rejected sector */
+        buf += done << SD_SECTOR_SHIFT;
+        sector += done;
+        count -= done;
+    }
+
+    return err;
+}
+
+void sd_set_crc(int enable)
+{
+    sd_crc_enabled = enable;
+}
+
+int sd_read_info(void)
+{
+    sd_card_info_t *ci = &sd_card_info;
+    int err;
+
+    if (sd_info_loaded) {
+        return 0;
+    }
+    if (sd_open_state != sdOpen_Done || ci->type == sdCardType_None) {
+        return sdError_NoCard;
+    }
+
+    err = sd_load_card_info();
+    if (err == 0 && ci->total_sectors == 0) {
+        ERROR("Card reports no sectors\n");
+        err = sdError_BadResponse;
+    }
+    if (err == 0) {
+        sd_info_loaded = 1;
+    }
+    return err;
+}
+
 const sd_card_info_t* sd_get_card_info(void)
 {
     return &sd_card_info;
@@ -26,11 +26,13 @@
 #define SD_SECTOR_SHIFT		9
 
 typedef enum {
+	sdError_Busy = 1,
 	sdError_OK = 0,
 	sdError_NoCard = -1,
 	sdError_Timeout = -2,
 	sdError_BadResponse = -3,
 	sdError_Unsupported = -4,
+	sdError_CRC = -5,
 } sd_error_t;
 
 typedef enum {
@@ -111,10 +113,40 @@ typedef struct {
 	sd_card_cid_t		cid;
 } sd_card_info_t;
 
+/*! Bring up the card, waiting in delay_ms() while it is busy */
 int sd_open(void);
+
+/*! Start bringing up the card, then call sd_open_step() until it returns
+ *  something other than sdError_Busy. CID and CSD are read by
+ *  sd_read_info() when they are first needed. */
+void sd_open_start(void);
+
+/*! Do the next step of the bring-up, <wait_ms> returns how long the
+ *  caller should wait before the next step */
+int sd_open_step(uint32_t *wait_ms);
+
+/*! Forget the card, the next sd_probe() looks for a new one */
 void sd_close(void);
+
+/*! Check if a card is there: an opened card must answer SEND_STATUS,
+ *  otherwise any card answering GO_IDLE_STATE counts
+ *  \return 1 if a card answered, 0 if not */
+int sd_probe(void);
+
 int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
 int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+
+/*! Read and decode CID and CSD if that was not done since the card was
+ *  brought up, this talks to the card
+ *  \return 0 or an sdError, also when the card reports no sectors */
+int sd_read_info(void);
+
+/*! Card type and, once sd_read_info() succeeded, the CID/CSD information
+ *  (total_sectors is 0 before that). Does no I/O. */
 const sd_card_info_t* sd_get_card_info(void);
 
+/*! Enable/disable CRC checking of commands and data (with retries on
+ *  CRC errors), takes effect on the next sd_open() */
+void sd_set_crc(int enable);
+
 #endif
@@ -20,10 +20,16 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <proto/exec.h>
 
 #include "sd.h"
 #include "spi.h"
+#include "timer.h"
 
+#ifdef SSPI_USE_LIBRARY
+struct Library *SSPIBase;
+#endif
 
 static void hexdump(const uint8_t *buf, unsigned int size)
 {
@@ -38,18 +44,98 @@ static void hexdump(const uint8_t *buf, unsigned int size)
 	printf("\n");
 }
 
-int main(void)
+#define BENCH_SECTORS		16
+#define BENCH_BYTES			(BENCH_SECTORS * SD_SECTOR_SIZE)
+#define BENCH_ROUNDS		32
+
+static void bench_result(const char *what, uint32_t bytes, uint32_t us)
 {
-	static uint8_t buf[SD_SECTOR_SIZE * 2];
+	if (us == 0) {
+		us = 1;
+	}
+	printf("%-28s %6lu KB/s\n", what, (unsigned long)((uint64_t)bytes * 1000000 / 1024 / us));
+}
+
+/* Throughput of the SPI kernels with no chip select asserted, and of
+   sequential card reads, for comparing CPU classes */
+static void bench(uint8_t *buf)
+{
+	uint32_t start, us;
+	int n;
+
+	printf("Fast kernels for %s, %s timer\n", spi_get_kernel_name(), timer_init() ? "EClock" : "TOD");
+
+	spi_obtain();
+	spi_set_speed(SPI_SPEED_FAST);
+
+	start = timer_get_us();
+	for (n = 0; n < BENCH_ROUNDS; n++) {
+		spi_read(buf, BENCH_BYTES);
+	}
+	bench_result("spi_read (even buffer)", BENCH_ROUNDS * BENCH_BYTES, timer_get_us() - start);
+
+	start = timer_get_us();
+	for (n = 0; n < BENCH_ROUNDS; n++) {
+		spi_read(buf + 1, BENCH_BYTES - 1);
+	}
+	bench_result("spi_read (odd buffer)", BENCH_ROUNDS * (BENCH_BYTES - 1), timer_get_us() - start);
+
+	memset(buf, 0xff, BENCH_BYTES);
+	start = timer_get_us();
+	for (n = 0; n < BENCH_ROUNDS; n++) {
+		spi_write(buf, BENCH_BYTES);
+	}
+	bench_result("spi_write", BENCH_ROUNDS * BENCH_BYTES, timer_get_us() - start);
 
-	
+	spi_set_speed(SPI_SPEED_SLOW);
+	start = timer_get_us();
+	spi_read(buf, SD_SECTOR_SIZE);
+	us = timer_get_us() - start;
+	printf("%-28s %6lu us per byte\n", "spi_read (slow)", (unsigned long)((us + SD_SECTOR_SIZE / 2) / SD_SECTOR_SIZE));
+	spi_set_speed(SPI_SPEED_FAST);
+
+	spi_release();
+
+	start = timer_get_us();
+	for (n = 0; n < BENCH_ROUNDS; n++) {
+		if (sd_read(buf, n * BENCH_SECTORS, BENCH_SECTORS) != 0) {
+			printf("sd_read failed\n");
+			return;
+		}
+	}
+	bench_result("sd_read (16 sectors)", BENCH_ROUNDS * BENCH_BYTES, timer_get_us() - start);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[BENCH_BYTES];
+
+#ifdef SSPI_USE_LIBRARY
+	SSPIBase = OpenLibrary(SSPI_LIBRARY_NAME, SSPI_LIBRARY_VERSION);
+	if(SSPIBase == NULL)
+	{
+		printf("sspi.library not found\n");
+		return 20;
+	}
+#endif
+
+	timer_init();
 	spi_initialize(SPI_CHANNEL_1);
 	sd_open();
 
-	printf("Read single sector\n");
-	printf("%d\n", sd_read(buf, 0, 1));
-	hexdump(buf, SD_SECTOR_SIZE);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench(buf);
+	} else {
+		printf("Read single sector\n");
+		printf("%d\n", sd_read(buf, 0, 1));
+		hexdump(buf, SD_SECTOR_SIZE);
+	}
+
 
+	timer_shutdown();
+#ifdef SSPI_USE_LIBRARY
+	CloseLibrary(SSPIBase);
+#endif
 
 	return 0;
 }